@@ -0,0 +1,411 @@
+#include "shpinx.h"
+
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/* datagrams taken from and handed to the kernel per system call */
+#ifndef SPHINX_HOST_BATCH
+#define SPHINX_HOST_BATCH 64
+#endif
+
+/* threads processing messages, 0 processes them on the receive thread */
+#ifndef SPHINX_HOST_WORKERS
+#define SPHINX_HOST_WORKERS 4
+#endif
+/* messages queued to each worker (power of two), further ones are dropped */
+#ifndef SPHINX_HOST_QUEUE
+#define SPHINX_HOST_QUEUE 256
+#endif
+
+/* ipv6 address of this mix, given on the command line */
+ipv6_addr_t local_addr;
+
+/* guards the state of sent messages, only touched by the receive loop here */
+mutex_t sent_msg_mutex = MUTEX_INIT;
+
+/* epoch keys of this mix and the tags seen under them */
+static sphinx_keyring keyring;
+
+/* held for reading while the keys are used, for writing while the receive thread rotates them */
+static pthread_rwlock_t keyring_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static int sock_fd = -1;
+
+/* interface of link local addresses, like the ones of the compiled in pki */
+static uint32_t scope_id = 0;
+static volatile sig_atomic_t running = 1;
+
+/* receive buffers, one message per datagram */
+static unsigned char rx_buf[SPHINX_HOST_BATCH][SPHINX_MESSAGE_SIZE];
+static struct iovec rx_iov[SPHINX_HOST_BATCH];
+static struct mmsghdr rx_msgs[SPHINX_HOST_BATCH];
+
+/* messages are sent from the buffer they were processed in, so each thread flushes its batch before reusing them */
+static __thread struct sockaddr_in6 tx_addr[SPHINX_HOST_BATCH];
+static __thread struct iovec tx_iov[SPHINX_HOST_BATCH];
+static __thread struct mmsghdr tx_msgs[SPHINX_HOST_BATCH];
+static __thread unsigned int tx_count = 0;
+
+#if SPHINX_HOST_WORKERS
+/* a received message waiting for its worker */
+typedef struct {
+    const sphinx_class *cls;
+    unsigned char message[SPHINX_MESSAGE_SIZE];
+} host_packet;
+
+/* lock free queue from the receive thread to one worker, each index is written by one side only */
+typedef struct {
+    _Alignas(64) atomic_uint head;
+    _Alignas(64) atomic_uint tail;
+    sem_t ready;
+    pthread_t thread;
+    uint32_t processed;
+    uint32_t dropped;
+    host_packet queue[SPHINX_HOST_QUEUE];
+} host_worker;
+
+static host_worker workers[SPHINX_HOST_WORKERS];
+static atomic_bool stopping = false;
+#endif /* SPHINX_HOST_WORKERS */
+
+int8_t get_local_ipv6_addr(ipv6_addr_t *result)
+{
+    *result = local_addr;
+    return 1;
+}
+
+static void flush_sends(void)
+{
+    unsigned int sent = 0;
+    int res;
+
+    while (sent < tx_count) {
+        if ((res = sendmmsg(sock_fd, &tx_msgs[sent], tx_count - sent, 0)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("error: could not send %u messages with udp, code %d\n", tx_count - sent, errno);
+            break;
+        }
+        sent += res;
+    }
+
+    tx_count = 0;
+}
+
+static int8_t host_send(ipv6_addr_t *dest_addr, unsigned char *message, size_t message_size)
+{
+    if (tx_count == SPHINX_HOST_BATCH) {
+        flush_sends();
+    }
+
+    memset(&tx_addr[tx_count], 0, sizeof(struct sockaddr_in6));
+    tx_addr[tx_count].sin6_family = AF_INET6;
+    tx_addr[tx_count].sin6_port = htons(SPHINX_PORT);
+    memcpy(&tx_addr[tx_count].sin6_addr, dest_addr, sizeof(ipv6_addr_t));
+    if (IN6_IS_ADDR_LINKLOCAL(&tx_addr[tx_count].sin6_addr)) {
+        tx_addr[tx_count].sin6_scope_id = scope_id;
+    }
+
+    tx_iov[tx_count].iov_base = message;
+    tx_iov[tx_count].iov_len = message_size;
+
+    memset(&tx_msgs[tx_count], 0, sizeof(struct mmsghdr));
+    tx_msgs[tx_count].msg_hdr.msg_name = &tx_addr[tx_count];
+    tx_msgs[tx_count].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+    tx_msgs[tx_count].msg_hdr.msg_iov = &tx_iov[tx_count];
+    tx_msgs[tx_count].msg_hdr.msg_iovlen = 1;
+    tx_count++;
+
+    return 1;
+}
+
+/* sends sphinx messages, batched with sendmmsg */
+sphinx_transport_t sphinx_transport = host_send;
+
+static void handle_signal(int sig)
+{
+    (void) sig;
+    running = 0;
+}
+
+static int8_t setup(const char *addr_str, const char *pki_path, const char *epoch_str)
+{
+    struct sockaddr_in6 local = { .sin6_family = AF_INET6, .sin6_port = htons(SPHINX_PORT) };
+    const unsigned char *private_key;
+    network_node *node_self;
+
+    if (ipv6_addr_from_str(&local_addr, addr_str) == NULL) {
+        puts("error: invalid ipv6 address");
+        return -1;
+    }
+
+    /* the private key of this mix is taken from the pki file or the build */
+    if (pki_path != NULL) {
+        if (sphinx_pki_load_file(pki_path) < 0) {
+            return -1;
+        }
+    }
+    #if SPHINX_PKI_DEFAULT
+    else if (sphinx_pki_load_default() < 0) {
+        return -1;
+    }
+    #endif /* SPHINX_PKI_DEFAULT */
+
+    if ((node_self = get_node(&local_addr)) == NULL) {
+        puts("error: no entry in pki with this ipv6 address");
+        return -1;
+    }
+
+    /* the compiled in pki holds public keys only */
+    if ((private_key = sphinx_pki_private_key()) == NULL) {
+        puts("error: no private key of this mix, build with SPHINX_PRIVATE_KEY or give it in the pki file");
+        return -1;
+    }
+
+    /* align key epoch with the rest of the network */
+    if (epoch_str != NULL) {
+        sphinx_set_epoch(strtoul(epoch_str, NULL, 10));
+    }
+
+    sphinx_keyring_init(&keyring, node_self, private_key);
+
+    /* bound to the pki address, several mixes can share one host */
+    memcpy(&local.sin6_addr, &local_addr, sizeof(ipv6_addr_t));
+    if (IN6_IS_ADDR_LINKLOCAL(&local.sin6_addr)) {
+        local.sin6_scope_id = scope_id;
+    }
+    if ((sock_fd = socket(AF_INET6, SOCK_DGRAM, 0)) < 0 || bind(sock_fd, (struct sockaddr *) &local, sizeof(local)) < 0) {
+        printf("error: creating udp socket, code %d\n", errno);
+        return -1;
+    }
+
+    for (unsigned int i=0; i<SPHINX_HOST_BATCH; i++) {
+        rx_iov[i].iov_base = rx_buf[i];
+        rx_iov[i].iov_len = SPHINX_MESSAGE_SIZE;
+        rx_msgs[i].msg_hdr.msg_iov = &rx_iov[i];
+        rx_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    return 1;
+}
+
+#if SPHINX_HOST_WORKERS
+static void *worker_run(void *arg)
+{
+    host_worker *worker = arg;
+    unsigned int tail = 0;
+    unsigned int head;
+
+    while (1) {
+        sem_wait(&worker->ready);
+
+        /* messages queued after the receive thread stopped are dropped */
+        if (atomic_load(&stopping)) {
+            return NULL;
+        }
+
+        if ((head = atomic_load_explicit(&worker->head, memory_order_acquire)) == tail) {
+            continue;
+        }
+
+        pthread_rwlock_rdlock(&keyring_lock);
+        for (; tail != head; tail++) {
+            host_packet *packet = &worker->queue[tail & (SPHINX_HOST_QUEUE - 1)];
+
+            if (sphinx_process_message(packet->message, packet->cls, &keyring) < 0) {
+                puts("sphinx: could not process sphinx message");
+            }
+            worker->processed++;
+        }
+        pthread_rwlock_unlock(&keyring_lock);
+
+        /* hand the slots back once the messages sent from them are out */
+        flush_sends();
+        atomic_store_explicit(&worker->tail, tail, memory_order_release);
+    }
+}
+
+static int8_t start_workers(void)
+{
+    sigset_t signals, old;
+
+    /* signals stop the receive thread only */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &old);
+
+    for (unsigned int i=0; i<SPHINX_HOST_WORKERS; i++) {
+        sem_init(&workers[i].ready, 0, 0);
+        if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+            puts("error: creating worker thread");
+            return -1;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return 1;
+}
+
+static void stop_workers(void)
+{
+    atomic_store(&stopping, true);
+
+    for (unsigned int i=0; i<SPHINX_HOST_WORKERS; i++) {
+        sem_post(&workers[i].ready);
+        pthread_join(workers[i].thread, NULL);
+        printf("sphinx: worker %u processed %lu dropped %lu\n", i, (unsigned long) workers[i].processed, (unsigned long) workers[i].dropped);
+    }
+}
+
+/* queues the message to the workers in turn, returns the worker or NULL if its queue is full */
+static host_worker *dispatch(unsigned char *message, const sphinx_class *cls)
+{
+    static unsigned int next = 0;
+    host_worker *worker = &workers[next];
+    unsigned int head = atomic_load_explicit(&worker->head, memory_order_relaxed);
+
+    next = (next + 1) % SPHINX_HOST_WORKERS;
+
+    if (head - atomic_load_explicit(&worker->tail, memory_order_acquire) == SPHINX_HOST_QUEUE) {
+        worker->dropped++;
+        return NULL;
+    }
+
+    worker->queue[head & (SPHINX_HOST_QUEUE - 1)].cls = cls;
+    memcpy(worker->queue[head & (SPHINX_HOST_QUEUE - 1)].message, message, cls->message_size);
+    atomic_store_explicit(&worker->head, head + 1, memory_order_release);
+
+    return worker;
+}
+#endif /* SPHINX_HOST_WORKERS */
+
+static void run(void)
+{
+    const sphinx_class *cls;
+    int count;
+
+    #if SPHINX_HOST_WORKERS
+    /* workers that got messages in this batch */
+    uint8_t woken[SPHINX_HOST_WORKERS];
+    host_worker *worker;
+    #endif /* SPHINX_HOST_WORKERS */
+
+    while (running) {
+
+        /* block for the first datagram, then take what else is already queued */
+        if ((count = recvmmsg(sock_fd, rx_msgs, SPHINX_HOST_BATCH, MSG_WAITFORONE, NULL)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("sphinx: error receiving data, code %d\n", errno);
+            return;
+        }
+
+        /* rotate the epoch keys between batches, workers wait meanwhile */
+        if (sphinx_current_epoch() != keyring.epoch) {
+            pthread_rwlock_wrlock(&keyring_lock);
+            sphinx_keyring_update(&keyring);
+            pthread_rwlock_unlock(&keyring_lock);
+        }
+
+        #if SPHINX_HOST_WORKERS
+        memset(woken, 0, sizeof(woken));
+        #endif /* SPHINX_HOST_WORKERS */
+
+        for (int i=0; i<count; i++) {
+            if ((rx_msgs[i].msg_hdr.msg_flags & MSG_TRUNC) || (cls = sphinx_class_for_message(rx_msgs[i].msg_len)) == NULL) {
+                puts("sphinx: received malformed data");
+            }
+            #if SPHINX_HOST_WORKERS
+            else if ((worker = dispatch(rx_buf[i], cls)) != NULL) {
+                woken[worker - workers] = 1;
+            }
+            #else
+            else if (sphinx_process_message(rx_buf[i], cls, &keyring) < 0) {
+                puts("sphinx: could not process sphinx message");
+            }
+            #endif /* SPHINX_HOST_WORKERS */
+        }
+
+        STATS_COUNT(recv_batches);
+
+        #if SPHINX_HOST_WORKERS
+        for (unsigned int i=0; i<SPHINX_HOST_WORKERS; i++) {
+            if (woken[i]) {
+                sem_post(&workers[i].ready);
+            }
+        }
+        #else
+        flush_sends();
+        #endif /* SPHINX_HOST_WORKERS */
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct sigaction action = { .sa_handler = handle_signal };
+    const char *pki_path = NULL;
+    const char *epoch_str = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:e:i:")) != -1) {
+        switch (opt) {
+        case 'i':
+            if ((scope_id = if_nametoindex(optarg)) == 0) {
+                printf("error: no interface %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'p':
+            pki_path = optarg;
+            break;
+        case 'e':
+            epoch_str = optarg;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        puts("usage: sphinx-host [-i <interface>] [-p <pki file>] [-e <epoch>] <ipv6 addr>");
+        return 1;
+    }
+
+    if (setup(argv[optind], pki_path, epoch_str) < 0) {
+        return 1;
+    }
+
+    /* no SA_RESTART, a signal interrupts the blocking receive */
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    printf("sphinx: %s mix running at ", sphinx_crypto_name);
+    ipv6_addr_print(&local_addr);
+    printf(" port %u, %u datagrams per batch, %u workers\n", SPHINX_PORT, SPHINX_HOST_BATCH, SPHINX_HOST_WORKERS);
+
+    #if SPHINX_HOST_WORKERS
+    if (start_workers() < 0) {
+        return 1;
+    }
+    #endif /* SPHINX_HOST_WORKERS */
+
+    run();
+
+    #if SPHINX_HOST_WORKERS
+    stop_workers();
+    #endif /* SPHINX_HOST_WORKERS */
+
+    sphinx_stats_print();
+    close(sock_fd);
+
+    return 0;
+}
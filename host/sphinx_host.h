@@ -0,0 +1,119 @@
+/* posix replacements for the riot apis the sphinx format core uses */
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/random.h>
+
+/* elements of an array, from kernel_defines.h */
+#define ARRAY_SIZE(a) (sizeof((a)) / sizeof((a)[0]))
+
+/* network addresses */
+typedef union {
+    uint8_t u8[16];
+    uint16_t u16[8];
+    uint32_t u32[4];
+    uint64_t u64[2];
+} ipv6_addr_t;
+
+#define IPV6_ADDR_MAX_STR_LEN INET6_ADDRSTRLEN
+
+static inline bool ipv6_addr_equal(const ipv6_addr_t *a, const ipv6_addr_t *b)
+{
+    return memcmp(a, b, sizeof(ipv6_addr_t)) == 0;
+}
+
+static inline ipv6_addr_t *ipv6_addr_from_str(ipv6_addr_t *result, const char *addr)
+{
+    return inet_pton(AF_INET6, addr, result) == 1 ? result : NULL;
+}
+
+static inline void ipv6_addr_print(const ipv6_addr_t *addr)
+{
+    char str[INET6_ADDRSTRLEN];
+
+    printf("%s", inet_ntop(AF_INET6, addr, str, sizeof(str)));
+}
+
+/* random numbers from the kernel */
+static inline void random_bytes(uint8_t *buf, size_t size)
+{
+    ssize_t res;
+
+    while (size > 0) {
+        if ((res = getrandom(buf, size, 0)) < 0) {
+            continue;
+        }
+        buf += res;
+        size -= res;
+    }
+}
+
+static inline uint32_t random_uint32(void)
+{
+    uint32_t r;
+
+    random_bytes((uint8_t *) &r, sizeof(r));
+    return r;
+}
+
+/* uniform in [a, b), draws in the biased top end of the range are repeated */
+static inline uint32_t random_uint32_range(uint32_t a, uint32_t b)
+{
+    uint32_t range = b - a;
+    uint32_t limit = UINT32_MAX - UINT32_MAX % range;
+    uint32_t r;
+
+    while ((r = random_uint32()) >= limit) {}
+
+    return a + r % range;
+}
+
+/* clocks are the number of microseconds per tick of the monotonic clock */
+typedef uint32_t ztimer_clock_t;
+#define ZTIMER_USEC ((ztimer_clock_t) 1)
+#define ZTIMER_MSEC ((ztimer_clock_t) 1000)
+#define ZTIMER_SEC ((ztimer_clock_t) 1000000)
+
+static inline uint32_t ztimer_now(ztimer_clock_t clock)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000) / clock;
+}
+
+/* the host daemon has no event loop, the types only complete the declarations shared with riot */
+typedef struct clist_node {
+    struct clist_node *next;
+} clist_node_t;
+typedef struct event event_t;
+typedef void (*event_handler_t)(event_t *event);
+struct event {
+    clist_node_t list_node;
+    event_handler_t handler;
+};
+typedef struct {
+    clist_node_t event_list;
+} event_queue_t;
+typedef int16_t kernel_pid_t;
+
+typedef pthread_mutex_t mutex_t;
+#define MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+
+static inline void mutex_init(mutex_t *mutex)
+{
+    pthread_mutex_init(mutex, NULL);
+}
+
+static inline void mutex_lock(mutex_t *mutex)
+{
+    pthread_mutex_lock(mutex);
+}
+
+static inline void mutex_unlock(mutex_t *mutex)
+{
+    pthread_mutex_unlock(mutex);
+}
@@ -4,12 +4,14 @@ int main(void)
 {
     puts("Generated RIOT application: 'sphinx-networking'");
 
+    /* nodes known at startup, more can be added with 'sphinx pki' */
+    #if SPHINX_PKI_DEFAULT
+    sphinx_pki_load_default();
+    #endif /* SPHINX_PKI_DEFAULT */
+
     /* verbose */
     puts("\nsphinx network nodes:");
-    for (uint8_t i=0; i<SPHINX_NET_SIZE; i++) {
-        ipv6_addr_print(&network_pki[i].addr);
-        puts("");
-    }
+    sphinx_pki_print();
     puts("");
 
     /* start sphinx immediately */
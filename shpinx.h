@@ -1,10 +1,13 @@
-#include "net/ipv6/addr.h"
-#include "kernel_defines.h"
-
 /* accumulated includes */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#ifdef SPHINX_HOST
+/* posix build of the format core for server mixes, see host/ */
+#include "host/sphinx_host.h"
+#else
+#include "kernel_defines.h"
 #include "net/netif.h"
 #include "net/ipv6/addr.h"
 #include "net/sock/udp.h"
@@ -13,22 +16,27 @@
 #include "shell.h"
 #include "thread.h"
 #include "random.h"
-#include "xtimer.h"
-
-#include "tweetnacl.h"
+#include "ztimer.h"
+#include "event/timeout.h"
 
 #define MODULE_SOCK_UDP 1
+#endif /* SPHINX_HOST */
 
 /* dev tools */
 #define DEBUG 0
 
 /* sphinx network metrics */
 #define SPHINX_PORT 45678
-#define SPHINX_NET_SIZE ARRAY_SIZE(network_pki)
 #define SPHINX_MAX_PATH 5
 
-/* sphinx format metrics */
+/* created messages derive shared secrets from a running blinded sender scalar instead of re-applying all blinding factors */
+#ifndef SPHINX_LINEAR_SECRETS
+#define SPHINX_LINEAR_SECRETS 1
+#endif
+
+/* sphinx format metrics, sizes of messages of the largest size class */
 #define KEY_SIZE 32
+#define HASH_SIZE 64
 #define ADDR_SIZE 16
 #define MAC_SIZE 16
 #define ID_SIZE 16
@@ -40,19 +48,207 @@
 #define HEADER_SIZE (KEY_SIZE + MAC_SIZE + ENC_ROUTING_SIZE)
 #define SURB_SIZE (ADDR_SIZE + MAC_SIZE + ENC_ROUTING_SIZE)
 #define PRG_STREAM_SIZE ( ENC_ROUTING_SIZE + NODE_PADDING_SIZE + MAC_SIZE + SURB_SIZE + PAYLOAD_SIZE)
+#define STREAM_BLOCK_SIZE 64
+#define HEADER_STREAM_SIZE (ENC_ROUTING_SIZE + NODE_PADDING_SIZE)
 #define SPHINX_MESSAGE_SIZE (HEADER_SIZE + MAC_SIZE + SURB_SIZE + PAYLOAD_SIZE)
 
+/* smaller messages for short payloads, each size class has its own max path and payload size */
+#ifndef SPHINX_SMALL_CLASS
+#define SPHINX_SMALL_CLASS 1
+#endif
+#ifndef SPHINX_SMALL_MAX_PATH
+#define SPHINX_SMALL_MAX_PATH 3
+#endif
+#ifndef SPHINX_SMALL_PAYLOAD_SIZE
+#define SPHINX_SMALL_PAYLOAD_SIZE 32
+#endif
+#if SPHINX_SMALL_CLASS && (SPHINX_SMALL_MAX_PATH < 3 || SPHINX_SMALL_MAX_PATH > SPHINX_MAX_PATH || SPHINX_SMALL_PAYLOAD_SIZE >= PAYLOAD_SIZE)
+#error "small size class must have a path of 3 to SPHINX_MAX_PATH hops and a payload below PAYLOAD_SIZE"
+#endif
+
+/* sizes of a message class with the given max path and payload size */
+#define SPHINX_CLASS(path, payload) { \
+    .max_path = (path), \
+    .payload_size = (payload), \
+    .enc_routing_size = (path) * NODE_ROUT_SIZE, \
+    .header_size = KEY_SIZE + MAC_SIZE + (path) * NODE_ROUT_SIZE, \
+    .surb_size = ADDR_SIZE + MAC_SIZE + (path) * NODE_ROUT_SIZE, \
+    .header_stream_size = (path) * NODE_ROUT_SIZE + NODE_PADDING_SIZE, \
+    .prg_stream_size = 2 * (path) * NODE_ROUT_SIZE + NODE_PADDING_SIZE + ADDR_SIZE + 2 * MAC_SIZE + (payload), \
+    .message_size = KEY_SIZE + ADDR_SIZE + 3 * MAC_SIZE + 2 * (path) * NODE_ROUT_SIZE + (payload) \
+}
+#define SPHINX_CLASS_COUNT (1 + SPHINX_SMALL_CLASS)
+#define SPHINX_LARGEST_CLASS (&sphinx_classes[SPHINX_CLASS_COUNT - 1])
+
 /* mix node metrics */
+#ifndef TAG_SIZE
 #define TAG_SIZE 4
-#define TAG_TABLE_LEN 128
-#define SENT_MSG_TABLE_SIZE 10
-#define EVENT_TIMEOUT_US 400000
-#define MSG_TIMEOUT_US 2000000
+#endif
+#ifndef SPHINX_INFLIGHT_SIZE
+#define SPHINX_INFLIGHT_SIZE 32
+#endif
+/* buckets of the id index of sent messages, power of two */
+#ifndef SPHINX_INFLIGHT_BUCKETS
+#define SPHINX_INFLIGHT_BUCKETS 32
+#endif
+#define MSG_TIMEOUT_MS 2000
 #define MAX_TRANSMITS 3
 
+/* replay filter: slots of the tag table of each epoch key and shard (power of two), tags are kept for the whole epoch */
+#ifndef SPHINX_REPLAY_SLOTS
+#define SPHINX_REPLAY_SLOTS 512
+#endif
+#if SPHINX_REPLAY_SLOTS < 8 || (SPHINX_REPLAY_SLOTS & (SPHINX_REPLAY_SLOTS - 1)) != 0
+#error "slots of the replay filter are masked, so they must be a power of two of at least 8"
+#endif
+/* independently locked parts of the filter, tags are spread over them so concurrent checks rarely wait */
+#ifndef SPHINX_REPLAY_SHARDS
+#define SPHINX_REPLAY_SHARDS 1
+#endif
+/* tags a table holds before messages under its key are dropped, linear probing needs free slots */
+#define SPHINX_REPLAY_CAPACITY (SPHINX_REPLAY_SLOTS * 3 / 4)
+
+/* mix keys are rotated every SPHINX_EPOCH_SEC, nodes keep the previous, current and next key */
+#ifndef SPHINX_EPOCH_SEC
+#define SPHINX_EPOCH_SEC 3600
+#endif
+#define SPHINX_KEY_EPOCHS 3
+
+/* clock difference to other nodes, received messages are tried with a neighbouring key only this close to its epoch */
+#ifndef SPHINX_EPOCH_SKEW_SEC
+#define SPHINX_EPOCH_SKEW_SEC 300
+#endif
+#if 2 * SPHINX_EPOCH_SKEW_SEC > SPHINX_EPOCH_SEC
+#error "SPHINX_EPOCH_SKEW_SEC must be at most half of SPHINX_EPOCH_SEC"
+#endif
+
+/* process received messages in the packet buffer of the network stack instead of copying them */
+#ifndef SPHINX_ZERO_COPY_RECV
+#define SPHINX_ZERO_COPY_RECV 1
+#endif
+
+/* received datagrams processed per wakeup before queued events get their turn, 1 handles one per event */
+#ifndef SPHINX_RECV_BATCH
+#define SPHINX_RECV_BATCH 8
+#endif
+
+/* pool that holds forwarded messages until SPHINX_MIX_THRESHOLD of them are ready or the oldest waited
+   SPHINX_MIX_TIMEOUT_MS, then sends them in random order, a pool size of 0 forwards every message at once */
+#ifndef SPHINX_MIX_POOL_SIZE
+#define SPHINX_MIX_POOL_SIZE 0
+#endif
+#ifndef SPHINX_MIX_THRESHOLD
+#define SPHINX_MIX_THRESHOLD SPHINX_MIX_POOL_SIZE
+#endif
+#ifndef SPHINX_MIX_TIMEOUT_MS
+#define SPHINX_MIX_TIMEOUT_MS 100
+#endif
+#if SPHINX_MIX_THRESHOLD > SPHINX_MIX_POOL_SIZE
+#error "mix threshold can't be larger than the mix pool"
+#endif
+
+/* number of messages that can be created or processed at the same time */
+#ifndef SPHINX_CTX_POOL_SIZE
+#define SPHINX_CTX_POOL_SIZE 2
+#endif
+#if !SPHINX_ZERO_COPY_RECV && SPHINX_CTX_POOL_SIZE < 2
+#error "copying receive needs a context besides the message under creation"
+#endif
+
+/* footprint profile chosen in the makefile and stack of the sphinx thread */
+#ifndef SPHINX_PROFILE
+#define SPHINX_PROFILE "default"
+#endif
+#ifndef SPHINX_STACK_SIZE
+#define SPHINX_STACK_SIZE THREAD_STACKSIZE_MAIN
+#endif
+
+/* pre-built headers and surbs, filled while the sphinx thread is idle */
+#ifndef SPHINX_PRECOMP_POOL_SIZE
+#define SPHINX_PRECOMP_POOL_SIZE 4
+#endif
+#ifndef SPHINX_PRECOMP_PER_DEST
+#define SPHINX_PRECOMP_PER_DEST 2
+#endif
+
+/* 'sphinx bench' command, timed runs of message creation and processing */
+#ifndef SPHINX_BENCH
+#define SPHINX_BENCH 0
+#endif
+#ifndef SPHINX_BENCH_ITERATIONS
+#define SPHINX_BENCH_ITERATIONS 100
+#endif
+
+/* 'sphinx sim' command, generated nodes in this process connected by an in-memory queue */
+#ifndef SPHINX_SIM
+#define SPHINX_SIM 0
+#endif
+#ifndef SPHINX_SIM_NODES
+#define SPHINX_SIM_NODES 6
+#endif
+#ifndef SPHINX_SIM_MESSAGES
+#define SPHINX_SIM_MESSAGES 2000
+#endif
+
+/* counters and latency histograms shown by 'sphinx stats', bucket i counts durations below 2^i us */
+#ifndef SPHINX_STATS
+#define SPHINX_STATS 1
+#endif
+#define SPHINX_STATS_BUCKETS 25
+
+/* compiled in pki of the test network, loaded at startup */
+#ifndef SPHINX_PKI_DEFAULT
+#define SPHINX_PKI_DEFAULT 1
+#endif
+#define SPHINX_DEFAULT_PKI_SIZE 6
+
+/* SPHINX_PRIVATE_KEY gives this node its private key at build time, as 64 hex digits in a string */
+
+/* payloads larger than one message are split into fragments, each acknowledged on its own; all nodes must use the same limit */
+#ifndef SPHINX_MAX_FRAGMENTS
+#define SPHINX_MAX_FRAGMENTS 8
+#endif
+#if SPHINX_MAX_FRAGMENTS > 32
+#error "fragments of a transfer are tracked in a 32 bit mask"
+#endif
+/* transfers reassembled at the same time and time after the last fragment until a slot may be reused */
+#ifndef SPHINX_REASSEMBLY_SLOTS
+#define SPHINX_REASSEMBLY_SLOTS 2
+#endif
+#ifndef SPHINX_REASSEMBLY_TIMEOUT_MS
+#define SPHINX_REASSEMBLY_TIMEOUT_MS 30000
+#endif
+/* completed transfers remembered, fragments retransmitted after a lost acknowledgement are acknowledged again */
+#ifndef SPHINX_COMPLETED_TRANSFERS
+#define SPHINX_COMPLETED_TRANSFERS 4
+#endif
+
+/* fragment header at the start of the payload: transfer id, fragment index, fragment count and data length */
+#define FRAGMENT_INDEX 4
+#define FRAGMENT_COUNT 5
+#define FRAGMENT_LEN 6
+#define FRAGMENT_HEADER_SIZE 7
+#define FRAGMENT_DATA_SIZE (PAYLOAD_SIZE - FRAGMENT_HEADER_SIZE)
+#define SPHINX_MAX_TRANSFER_SIZE (SPHINX_MAX_FRAGMENTS * FRAGMENT_DATA_SIZE)
+
 /* readability */
 #define CUTT_OFF 16
 
+/* priorities of the sphinx thread, lower queues are served first */
+#define SPHINX_PRIO_NETWORK 0   /* received messages to forward or deliver, mix pool flushes */
+#define SPHINX_PRIO_LOCAL 1     /* retransmit timer, stop */
+#define SPHINX_PRIO_CREATE 2    /* next step of the message under creation */
+#define SPHINX_PRIO_SEND 3      /* new messages and retransmits waiting for their creation */
+#define SPHINX_PRIO_IDLE 4      /* next step of a pre-built header */
+#define SPHINX_PRIO_COUNT 5
+
+/* steps of message creation, received messages are processed in between */
+#define SPHINX_STEP_PATH 0
+#define SPHINX_STEP_SECRETS 1
+#define SPHINX_STEP_HEADER 2
+#define SPHINX_STEP_SURB 3
+#define SPHINX_STEP_PAYLOAD 4
+
 /* types */
 
 typedef struct {
@@ -62,49 +258,331 @@ typedef struct {
     uint32_t timestamp;
     uint8_t transmit_count;
     ipv6_addr_t dest_addr;
-    char *data;
+    /* fragment header followed by the part of the payload */
+    char data[PAYLOAD_SIZE];
     size_t data_len;
+    uint32_t transfer;
+    uint8_t used;
+    /* message under creation between the steps of handle_send() */
+    struct sphinx_ctx *ctx;
+    uint32_t create_start;
+    /* posted for a (re)transmit, an acknowledgement meanwhile leaves freeing it to the sphinx thread */
+    uint8_t queued;
+    uint8_t acked;
 } event_send;
 
+/* identifies a payload passed to sphinx_send_async(), the id of its transfer */
+typedef uint32_t send_handle;
+
+typedef struct {
+    uint32_t transfer;
+    /* bit i is set once fragment i arrived */
+    uint32_t received;
+    /* arrival of the last fragment */
+    uint32_t timestamp;
+    uint16_t size;
+    uint8_t count;
+    uint8_t used;
+    unsigned char data[SPHINX_MAX_TRANSFER_SIZE];
+} reassembly_slot;
+
+typedef struct {
+    uint32_t transfer;
+    uint8_t count;
+} completed_transfer;
+
+typedef struct {
+    uint32_t buckets[SPHINX_STATS_BUCKETS];
+} stats_histogram;
+
+typedef struct {
+    uint32_t received;
+    uint32_t sent;
+    uint32_t forwarded;
+    uint32_t delivered;
+    uint32_t acked;
+    uint32_t retransmitted;
+    uint32_t discarded;
+    uint32_t mac_failures;
+    uint32_t replays;
+    uint32_t replay_overflows;
+    uint32_t epoch_mismatches;
+    uint32_t recv_batches;
+    /* returns of the event loop wait and the time counting started at in ms */
+    uint32_t wakeups;
+    uint32_t wakeups_since;
+    uint32_t mix_flushes;
+    uint32_t mix_flushed;
+    uint32_t mix_peak;
+    stats_histogram create;
+    stats_histogram process_forward;
+    stats_histogram process_receive;
+    stats_histogram process_reply;
+    stats_histogram ack_rtt;
+    stats_histogram mix_delay;
+} sphinx_statistics;
+
+typedef int8_t (*sphinx_transport_t)(ipv6_addr_t *dest_addr, unsigned char *message, size_t message_size);
+
 typedef struct {
     ipv6_addr_t addr;
     unsigned char public_key[KEY_SIZE];
-    unsigned char private_key[KEY_SIZE];
+    /* relative capacity as a mix, 0 keeps the node off paths of others */
+    uint16_t weight;
+    /* public key of the node in the epoch it was last used in */
+    uint32_t epoch;
+    uint8_t epoch_valid;
+    unsigned char epoch_public_key[KEY_SIZE];
 } network_node;
 
+/* entry of the compiled in table, private keys are given to each node on its own */
+typedef struct {
+    ipv6_addr_t addr;
+    unsigned char public_key[KEY_SIZE];
+} pki_record;
+
+typedef struct {
+    uint8_t max_path;
+    uint16_t payload_size;
+    uint16_t enc_routing_size;
+    uint16_t header_size;
+    uint16_t surb_size;
+    uint16_t header_stream_size;
+    uint16_t prg_stream_size;
+    uint16_t message_size;
+} sphinx_class;
+
+typedef struct sphinx_ctx {
+    /* size class of the message */
+    const sphinx_class *cls;
+    /* stores created and received sphinx messages */
+    unsigned char message[SPHINX_MESSAGE_SIZE];
+    /* salsa20 keys of the hops, derived once from the shared secrets */
+    unsigned char stream_keys[2*SPHINX_MAX_PATH][KEY_SIZE];
+    /* start of the keystream of each hop of one path, used for padding and routing */
+    unsigned char header_streams[SPHINX_MAX_PATH][HEADER_STREAM_SIZE];
+    /* address the message is sent to */
+    ipv6_addr_t dest_addr;
+    /* state of message creation kept between its steps */
+    uint8_t step;
+    uint8_t path_len_dest;
+    uint8_t path_len_reply;
+    network_node *path_nodes[2*SPHINX_MAX_PATH];
+    unsigned char shared_secrets[2*SPHINX_MAX_PATH][KEY_SIZE];
+    uint8_t used;
+} sphinx_ctx;
+
+typedef struct {
+    const sphinx_class *cls;
+    ipv6_addr_t dest_addr;
+    ipv6_addr_t first_hop;
+    unsigned char id[ID_SIZE];
+    uint32_t epoch;
+    uint8_t used;
+    uint8_t path_len_dest;
+    unsigned char shared_secrets[SPHINX_MAX_PATH][KEY_SIZE];
+    unsigned char header[HEADER_SIZE];
+    unsigned char surb[SURB_SIZE];
+} sphinx_precomp;
+
+typedef struct {
+    unsigned char tags[SPHINX_REPLAY_SLOTS][TAG_SIZE];
+    uint8_t used[SPHINX_REPLAY_SLOTS / 8];
+    uint32_t count;
+} replay_table;
+
+typedef struct {
+    mutex_t lock;
+    replay_table table;
+} replay_shard;
+
+typedef struct {
+    replay_shard shards[SPHINX_REPLAY_SHARDS];
+} replay_filter;
+
+typedef struct {
+    uint32_t epoch;
+    uint8_t valid;
+    /* private key is usable with sphinx_scalarmult, else blind in two steps */
+    uint8_t encoded;
+    unsigned char epoch_factor[KEY_SIZE];
+    unsigned char private_key[KEY_SIZE];
+    /* tags of messages seen under this key */
+    replay_filter replay;
+} epoch_key;
+
+typedef struct {
+    network_node *node;
+    unsigned char private_key[KEY_SIZE];
+    uint32_t epoch;
+    epoch_key keys[SPHINX_KEY_EPOCHS];
+} sphinx_keyring;
+
 
 /* global variables */
 
 /* idicator if sphinx thread is running */
 extern kernel_pid_t sphinx_pid;
 
-/* event queue for sphinx thread */
-extern event_queue_t sphinx_queue;
+/* event queues for sphinx thread, one per priority */
+extern event_queue_t sphinx_queues[SPHINX_PRIO_COUNT];
 
 /* ipv6 address of this node */
 extern ipv6_addr_t local_addr;
 
-/* address of message destination */
-extern ipv6_addr_t dest_addr;
+/* mutex for variables storing state of sent messages */
+extern mutex_t sent_msg_mutex;
 
-/* stores random bytes from stream cipher */
-extern unsigned char prg_stream[PRG_STREAM_SIZE];
+/* sends sphinx messages, udp_send unless messages are kept on this node */
+extern sphinx_transport_t sphinx_transport;
 
-/* stores created and received sphinx messages */
-extern unsigned char sphinx_message[SPHINX_MESSAGE_SIZE];
+/* datagrams processed per wakeup */
+extern uint8_t sphinx_recv_batch;
 
-/* store state of sent messages */
-extern event_send sent_msg_table[SENT_MSG_TABLE_SIZE];
-extern uint8_t sent_msg_count;
-extern mutex_t sent_msg_mutex;
+#if SPHINX_STATS
+/* counters of the sphinx thread */
+extern sphinx_statistics sphinx_stats;
+
+#ifdef SPHINX_HOST
+/* workers of the host build count at the same time */
+#define STATS_ADD(value, n) __atomic_fetch_add(&(value), (n), __ATOMIC_RELAXED)
+#else
+#define STATS_ADD(value, n) ((value) += (n))
+#endif /* SPHINX_HOST */
+#define STATS_INC(value) STATS_ADD(value, 1)
+
+static inline void stats_record(stats_histogram *histogram, uint32_t us)
+{
+    uint8_t bucket = us ? 32 - __builtin_clz(us) : 0;
+
+    STATS_INC(histogram->buckets[bucket < SPHINX_STATS_BUCKETS ? bucket : SPHINX_STATS_BUCKETS - 1]);
+}
+
+#define STATS_COUNT(counter) STATS_INC(sphinx_stats.counter)
+#define STATS_COUNT_N(counter, n) STATS_ADD(sphinx_stats.counter, (n))
+#define STATS_PEAK(counter, value) do { if ((value) > sphinx_stats.counter) sphinx_stats.counter = (value); } while (0)
+#define STATS_NOW() ztimer_now(ZTIMER_USEC)
+#define STATS_TIME(histogram, us) stats_record(&sphinx_stats.histogram, (us))
+#else
+#define STATS_COUNT(counter)
+#define STATS_COUNT_N(counter, n) ((void) (n))
+#define STATS_PEAK(counter, value) ((void) (value))
+#define STATS_NOW() 0
+#define STATS_TIME(histogram, us) ((void) (us))
+#endif /* SPHINX_STATS */
 
 
 /* global funcitons */
 int8_t sphinx_start(void);
+int8_t sphinx_send_async(ipv6_addr_t *dest_addr, const char *data, size_t data_len, send_handle *handle);
+int8_t sphinx_send_pending(send_handle handle);
 void handle_send(event_t *event);
 void handle_stop(event_t *event);
-int8_t sphinx_create_message(unsigned char *message, unsigned char *id, ipv6_addr_t *dest_addr, char *data, size_t data_len);
-int8_t sphinx_process_message(unsigned char *message, network_node *node_self, unsigned char tag_table[][TAG_SIZE], uint8_t *tag_count);
+void handle_retransmit(event_t *event);
+sphinx_ctx *sphinx_ctx_alloc(void);
+void sphinx_ctx_free(sphinx_ctx *ctx);
+size_t sphinx_ctx_ram(void);
+void sphinx_mem_print(void);
+int8_t bulid_mix_path(network_node *path_nodes[], uint8_t path_len, ipv6_addr_t *start_addr, ipv6_addr_t *dest_addr);
+int8_t sphinx_create_message(sphinx_ctx *ctx, unsigned char *id, ipv6_addr_t *dest_addr, char *data, size_t data_len);
+int8_t sphinx_create_begin(sphinx_ctx *ctx, size_t data_len);
+int8_t sphinx_create_step(sphinx_ctx *ctx, unsigned char *id, ipv6_addr_t *dest_addr, char *data, size_t data_len);
+uint8_t sphinx_random_path_len(const sphinx_class *cls);
+int8_t sphinx_create_header(sphinx_ctx *ctx, unsigned char shared_secrets[][KEY_SIZE], uint8_t path_len_dest, uint8_t path_len_reply, unsigned char *id, ipv6_addr_t *dest_addr);
+void sphinx_seal_payload(sphinx_ctx *ctx, unsigned char shared_secrets[][KEY_SIZE], uint8_t path_len_dest, char *data, size_t data_len);
+int8_t sphinx_create_selftest(void);
+void calculate_shared_secrets(unsigned char *sphinx_message, unsigned char shared_secrets[][KEY_SIZE], unsigned char *node_keys[], uint8_t path_len, const unsigned char *sender_secret, uint8_t linear);
+void generate_header_streams(const sphinx_class *cls, unsigned char header_streams[][HEADER_STREAM_SIZE], unsigned char stream_keys[][KEY_SIZE], uint8_t path_len);
+void calculate_nodes_padding(const sphinx_class *cls, unsigned char *nodes_padding, unsigned char header_streams[][HEADER_STREAM_SIZE], uint8_t path_len);
+void encapsulate_routing_and_mac(const sphinx_class *cls, unsigned char *routing_and_mac, unsigned char shared_secrets[][KEY_SIZE], unsigned char header_streams[][HEADER_STREAM_SIZE], network_node *path_nodes[], uint8_t path_len, unsigned char *id);
+int8_t sphinx_precomp_take(sphinx_ctx *ctx, unsigned char *id, ipv6_addr_t *dest_addr, char *data, size_t data_len);
+int8_t sphinx_precomp_refill(void);
+void sphinx_precomp_init(event_queue_t *queue);
+int8_t sphinx_precomp_cancel(void);
+size_t sphinx_precomp_ram(void);
+int8_t sphinx_process_message(unsigned char *message, const sphinx_class *cls, sphinx_keyring *keyring);
+
+/* fragmentation */
+size_t fragment_encode(unsigned char *dest, uint32_t transfer, uint8_t index, uint8_t count, const char *data, uint8_t data_len);
+int8_t fragment_receive(const unsigned char *payload, size_t payload_size);
+size_t fragment_ram(void);
+
+/* mix pool */
+extern uint8_t sphinx_mix_threshold;
+void sphinx_mix_init(event_queue_t *queue);
+uint8_t sphinx_mix_count(void);
+size_t sphinx_mix_ram(void);
+void sphinx_mix_flush(void);
+int8_t sphinx_mix_forward(ipv6_addr_t *next_hop, unsigned char *message, size_t message_size);
+
+/* size classes */
+extern const sphinx_class sphinx_classes[SPHINX_CLASS_COUNT];
+const sphinx_class *sphinx_class_for_payload(size_t payload_size);
+const sphinx_class *sphinx_class_for_message(size_t message_size);
+void replay_filter_init(replay_filter *filter);
+int8_t replay_filter_check(replay_filter *filter, unsigned char *tag);
+uint16_t inflight_count(void);
+size_t inflight_ram(void);
+event_send *inflight_alloc(void);
+void inflight_free(event_send *msg);
+uint32_t inflight_new_transfer(void);
+int8_t inflight_transfer_pending(uint32_t transfer);
+void inflight_insert(event_send *msg);
+event_send *inflight_find(unsigned char *id);
+int8_t inflight_remove(unsigned char *id);
+event_send *inflight_next_expired(uint32_t now);
+int8_t inflight_next_deadline(uint32_t *deadline);
+void inflight_reschedule(event_send *msg);
+int8_t inflight_selftest(void);
+uint32_t sphinx_current_epoch(void);
+void sphinx_set_epoch(uint32_t epoch);
+void sphinx_keyring_init(sphinx_keyring *keyring, network_node *node, const unsigned char *private_key);
+void sphinx_keyring_update(sphinx_keyring *keyring);
+
+/* crypto backend */
+extern const char *sphinx_crypto_name;
+void sphinx_scalarmult(unsigned char *dest, const unsigned char *scalar, const unsigned char *point);
+void sphinx_scalarmult_base(unsigned char *dest, const unsigned char *scalar);
+void sphinx_keypair(unsigned char *public_key, unsigned char *secret_key);
+void sphinx_hash(unsigned char *dest, const unsigned char *data, size_t data_len);
+void sphinx_onetimeauth(unsigned char *mac, const unsigned char *data, size_t data_len, const unsigned char *key);
+int8_t sphinx_onetimeauth_verify(const unsigned char *mac, const unsigned char *data, size_t data_len, const unsigned char *key);
+void sphinx_hsalsa20(unsigned char *dest, const unsigned char *input, const unsigned char *key);
+void sphinx_salsa20_block(unsigned char *dest, const unsigned char *input, const unsigned char *key);
+int8_t sphinx_crypto_selftest(void);
+
+/* pki directory */
+#if SPHINX_PKI_DEFAULT
+extern const pki_record sphinx_default_pki[SPHINX_DEFAULT_PKI_SIZE];
+#endif
+int8_t sphinx_pki_add(ipv6_addr_t *addr, const unsigned char *public_key, const unsigned char *private_key);
+int8_t sphinx_pki_load_default(void);
+#if defined(CPU_NATIVE) || defined(SPHINX_HOST)
+int8_t sphinx_pki_load_file(const char *path);
+#endif
+int8_t sphinx_pki_set_weight(ipv6_addr_t *addr, uint16_t weight);
+int8_t sphinx_pki_sample(network_node *nodes[], uint8_t count, ipv6_addr_t *start_addr, ipv6_addr_t *dest_addr);
+void sphinx_pki_truncate(uint32_t count);
+void sphinx_pki_clear(void);
+int8_t sphinx_pki_stash(void);
+void sphinx_pki_unstash(void);
+int8_t sphinx_pki_add_generated(unsigned char *private_key);
+uint32_t sphinx_pki_count(void);
+uint32_t sphinx_pki_index(ipv6_addr_t *addr);
+network_node *sphinx_pki_node(uint32_t index);
+const unsigned char *sphinx_pki_private_key(void);
+void sphinx_pki_print(void);
+int8_t parse_hex_key(unsigned char *dest, const char *hex);
+
+/* benchmark */
+int8_t sphinx_bench(uint16_t iterations);
+
+/* statistics */
+void sphinx_stats_print(void);
+void sphinx_stats_reset(void);
+
+/* simulation */
+int8_t sphinx_sim(uint16_t messages, uint16_t window, uint32_t nodes);
 
 /* helper functions */
 void print_hex_memory (void *mem, uint16_t mem_size);
@@ -114,66 +592,17 @@ network_node* get_node(ipv6_addr_t *node_addr);
 int8_t udp_send(ipv6_addr_t *dest_addr, unsigned char *message, size_t message_size);
 void hash_blinding_factor(unsigned char *dest, unsigned char *public_key, unsigned char *sharde_secret);
 void hash_shared_secret(unsigned char *dest, unsigned char *sharde_secret);
-void xor_backwards_inplace(unsigned char *dest, size_t dest_size, unsigned char *arg, size_t arg_size, uint16_t num_bytes);
+void xor_inplace(unsigned char *dest, const unsigned char *arg, size_t num_bytes);
+void derive_stream_key(unsigned char *stream_key, const unsigned char *nonce, const unsigned char *key);
+void xor_stream_keyed(unsigned char *dest, size_t len, size_t offset, const unsigned char *nonce, const unsigned char *stream_key);
+void xor_stream(unsigned char *dest, size_t len, size_t offset, const unsigned char *nonce, const unsigned char *key);
+void clamp_scalar(unsigned char *dest, unsigned char *scalar);
+void multiply_scalars(unsigned char *dest, unsigned char *a, unsigned char *b);
+int8_t encode_scalar(unsigned char *dest, unsigned char *scalar);
+void hash_epoch_factor(unsigned char *dest, unsigned char *public_key, uint32_t epoch);
+unsigned char *get_epoch_public_key(network_node *node, uint32_t epoch);
+epoch_key *epoch_shared_secret(unsigned char *dest, sphinx_keyring *keyring, unsigned char *public_key, uint8_t try);
 
 
 /* static values */
 static const unsigned char nonce[] = { 0xff, 0xcb, 0x7c, 0x4f, 0xcc, 0x0e, 0xf9, 0x29, 0xde, 0xaa, 0x42, 0xd2, 0xa2, 0x3e, 0x5f, 0xa3, 0xbd, 0x6d, 0xd8, 0x76, 0xf8, 0x7c, 0x84, 0x3f };
-
-static const network_node network_pki[] =
-{
-    /* 0 */
-    {
-        /* ipv6 address */
-        {{0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x30, 0xc7, 0x6e, 0xff, 0xfe, 0x39, 0xa0, 0x5f}},
-        /* public key */
-        {0xb3, 0x92, 0x25, 0xc9, 0xd8, 0x41, 0x9d, 0x06, 0xb3, 0x7a, 0xe2, 0x64, 0x8b, 0xca, 0x9f, 0x83, 0x1b, 0xd1, 0xee, 0x08, 0x02, 0xd1, 0xcd, 0x8f, 0xbf, 0x36, 0x5e, 0x47, 0xba, 0xdb, 0x68, 0x09},
-        /* secret key */
-        {0x23, 0x4f, 0xd3, 0x74, 0x94, 0x07, 0xb7, 0xdf, 0x6c, 0xd4, 0x0e, 0x0a, 0x80, 0xde, 0xb5, 0xe1, 0xde, 0x06, 0x7c, 0x49, 0x6d, 0x77, 0xf5, 0x40, 0x1e, 0xed, 0xf9, 0x8d, 0xf5, 0x7f, 0xf0, 0x37}
-    },
-    /* 1 */
-    {
-        /* ipv6 address */
-        {{0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xb0, 0x6d, 0xfe, 0xff, 0xfe, 0xfd, 0x0a, 0x0d}},
-        /* public key */
-        {0xd5, 0x88, 0x47, 0x3e, 0x97, 0xc0, 0x53, 0x30, 0xa9, 0x32, 0xf5, 0x74, 0xa0, 0xd9, 0x30, 0xec, 0x03, 0x1e, 0x34, 0x2e, 0xec, 0xc3, 0x9b, 0x67, 0xc1, 0x56, 0xe1, 0x1f, 0x73, 0xef, 0x2b, 0x3a},
-        /* secret key */
-        {0xae, 0x22, 0x7e, 0x1c, 0xab, 0xf7, 0x1d, 0xbb, 0x9a, 0xd6, 0x72, 0x3e, 0x6d, 0x6d, 0x6d, 0xb9, 0x75, 0x12, 0xaf, 0x23, 0x18, 0xdb, 0xc2, 0x5c, 0x92, 0x17, 0x32, 0x23, 0x67, 0xfa, 0x33, 0x74}
-    },
-    /* 2 */
-    {
-        /* ipv6 address */
-        {{0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x28, 0x29, 0x2a, 0xff, 0xfe, 0x75, 0x73, 0x3f}},
-        /* public key */
-        {0x2b, 0xef, 0xff, 0x0b, 0x68, 0x1f, 0xd8, 0x14, 0x02, 0xb1, 0x20, 0x27, 0xaa, 0xda, 0x1b, 0x0a, 0x85, 0x63, 0x75, 0x8e, 0xab, 0x00, 0xe1, 0x80, 0xa9, 0x3c, 0xb9, 0x6b, 0x3b, 0xb1, 0xf3, 0x44},
-        /* secret key */
-        {0x71, 0xe2, 0xef, 0x0e, 0x44, 0xf5, 0xf3, 0x95, 0x1c, 0xf7, 0xc0, 0x5c, 0xcb, 0x70, 0xec, 0x23, 0x31, 0x10, 0x51, 0xfb, 0x4f, 0xe8, 0x24, 0x92, 0x6e, 0xc7, 0x69, 0x49, 0x21, 0x8a, 0xa9, 0xc4}
-    },
-    /* 3 */
-    {
-        /* ipv6 address */
-        {{0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x20, 0x65, 0x35, 0xff, 0xfe, 0xc7, 0x45, 0x5b}},
-        /* public key */
-        {0x87, 0x68, 0x06, 0xf2, 0x59, 0x83, 0x5d, 0x43, 0x9f, 0x8a, 0xf5, 0xdc, 0xab, 0x41, 0x74, 0x85, 0x8f, 0x9e, 0x1c, 0xe2, 0x75, 0x60, 0x14, 0xb8, 0x6c, 0x52, 0xc6, 0x22, 0xb8, 0xee, 0xbb, 0x1e},
-        /* secret key */
-        {0x74, 0x0e, 0x97, 0xf1, 0x02, 0x9d, 0x65, 0x0b, 0xa9, 0xd7, 0x5a, 0x51, 0x10, 0xf4, 0x45, 0x0b, 0x40, 0xf4, 0x4e, 0x71, 0x49, 0x1b, 0xd2, 0x43, 0xbf, 0x40, 0xf8, 0xb0, 0x6f, 0xb9, 0x7b, 0x7c}
-    },
-    /* 4 */
-    {
-        /* ipv6 address */
-        {{0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xa0, 0xc6, 0xf3, 0xff, 0xfe, 0xf6, 0x2b, 0xb6}},
-        /* public key */
-        {0x3d, 0x55, 0x59, 0xfc, 0x81, 0x23, 0x01, 0xe3, 0x83, 0x2c, 0x97, 0x2c, 0x4b, 0x54, 0x22, 0x23, 0x88, 0x25, 0x71, 0x4e, 0x5b, 0xdc, 0xb5, 0x93, 0x40, 0x8b, 0xe4, 0xb5, 0xf0, 0xd1, 0xa6, 0x1a},
-        /* secret key */
-        {0x83, 0xfe, 0x1c, 0xe6, 0x48, 0x51, 0xf2, 0x6b, 0xbb, 0xba, 0x06, 0xdb, 0x2f, 0xe4, 0xdb, 0x44, 0x16, 0x4c, 0xf9, 0xbd, 0x2a, 0x69, 0x79, 0x11, 0x29, 0x46, 0x0a, 0x83, 0x3e, 0x9e, 0x4d, 0xa6}
-    },
-    /* 5 */
-    {
-        /* ipv6 address */
-        {{0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x28, 0x9f, 0x66, 0xff, 0xfe, 0xa9, 0x1b, 0x31}},
-        /* public key */
-        {0xad, 0xb9, 0x1f, 0x56, 0x9a, 0xff, 0x33, 0x3a, 0xb6, 0x12, 0xb8, 0x91, 0x19, 0xc7, 0x80, 0xc2, 0x27, 0xe2, 0xe0, 0x6d, 0xef, 0xc3, 0x0a, 0x6b, 0xb3, 0x51, 0xa9, 0x77, 0x88, 0xa0, 0x50, 0x3e},
-        /* secret key */
-        {0x41, 0xa6, 0xef, 0x58, 0x7c, 0x26, 0xbf, 0x17, 0xf4, 0x33, 0xd0, 0x63, 0x74, 0x81, 0xc4, 0x08, 0x0c, 0xf2, 0x28, 0x20, 0x69, 0x94, 0x30, 0xbd, 0xbe, 0x18, 0x08, 0xa8, 0xc1, 0x82, 0x85, 0x73}
-    }
-};
\ No newline at end of file
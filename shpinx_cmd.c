@@ -1,11 +1,5 @@
 #include "shpinx.h"
 
-/* address of message destination */
-ipv6_addr_t dest_addr;
-
-/* event for sending a message */
-event_send sphinx_send;
-
 /* parse user input */
 int sphinx_cmd(int argc, char **argv)
 { 
@@ -28,7 +22,7 @@ int sphinx_cmd(int argc, char **argv)
             }
             
             event_t sphinx_stop = { .handler = handle_stop };
-            event_post(&sphinx_queue, &sphinx_stop);
+            event_post(&sphinx_queues[SPHINX_PRIO_LOCAL], &sphinx_stop);
 
             if (thread_kill_zombie(sphinx_pid) != 1) {
                 puts("error: can't stop thread");
@@ -39,10 +33,178 @@ int sphinx_cmd(int argc, char **argv)
             puts("sphinx: thread stopped"); 
             return 0;
         }
+        if (strcmp(argv[1], "epoch") == 0) {
+            printf("sphinx: key epoch %lu\n", (unsigned long) sphinx_current_epoch());
+            return 0;
+        }
+        if (strcmp(argv[1], "stats") == 0) {
+            sphinx_stats_print();
+            return 0;
+        }
+        if (strcmp(argv[1], "mix") == 0) {
+            printf("sphinx: %u of %u messages in mix pool, flush at %u\n", sphinx_mix_count(), SPHINX_MIX_POOL_SIZE, sphinx_mix_threshold);
+            return 0;
+        }
+        if (strcmp(argv[1], "mem") == 0) {
+            sphinx_mem_print();
+            return 0;
+        }
+        if (strcmp(argv[1], "batch") == 0) {
+            printf("sphinx: %u messages per wakeup\n", sphinx_recv_batch);
+            return 0;
+        }
+        if (strcmp(argv[1], "pki") == 0) {
+            printf("sphinx: %lu nodes in pki, %s\n", (unsigned long) sphinx_pki_count(),
+                   sphinx_pki_private_key() ? "private key of this node known" : "no private key of this node");
+            return 0;
+        }
+        if (strcmp(argv[1], "selftest") == 0) {
+            /* nodes with different crypto backends only interoperate if both pass */
+            if (sphinx_crypto_selftest() < 0 || sphinx_create_selftest() < 0) {
+                printf("sphinx: %s self-test failed\n", sphinx_crypto_name);
+                return 1;
+            }
+            printf("sphinx: %s self-test passed\n", sphinx_crypto_name);
+
+            /* the table of sent messages belongs to the sphinx thread while it runs */
+            if (sphinx_pid) {
+                puts("sphinx: stop sphinx to check the table of sent messages too");
+                return 0;
+            }
+            if (inflight_selftest() < 0) {
+                puts("sphinx: table of sent messages self-test failed");
+                return 1;
+            }
+            puts("sphinx: table of sent messages self-test passed");
+            return 0;
+        }
+    }
+
+    if (argc == 3 && strcmp(argv[1], "epoch") == 0) {
+        /* align key epoch with the rest of the network */
+        sphinx_set_epoch(strtoul(argv[2], NULL, 10));
+        printf("sphinx: key epoch %lu\n", (unsigned long) sphinx_current_epoch());
+        return 0;
     }
     
+    if (argc == 3 && strcmp(argv[1], "mix") == 0) {
+        /* messages already in the pool go out with the flush timer */
+        unsigned long threshold = strtoul(argv[2], NULL, 10);
+
+        if (threshold > SPHINX_MIX_POOL_SIZE) {
+            printf("error: mix threshold must be between 0 and %u\n", SPHINX_MIX_POOL_SIZE);
+            return 1;
+        }
+
+        sphinx_mix_threshold = threshold;
+        printf("sphinx: %u of %u messages in mix pool, flush at %u\n", sphinx_mix_count(), SPHINX_MIX_POOL_SIZE, sphinx_mix_threshold);
+        return 0;
+    }
+
+    if (argc == 3 && strcmp(argv[1], "batch") == 0) {
+        /* a byte is written at once, the sphinx thread reads it on its next wakeup */
+        unsigned long batch = strtoul(argv[2], NULL, 10);
+
+        if (batch == 0 || batch > UINT8_MAX) {
+            puts("error: batch size must be between 1 and 255");
+            return 1;
+        }
+
+        sphinx_recv_batch = batch;
+        printf("sphinx: %u messages per wakeup\n", sphinx_recv_batch);
+        return 0;
+    }
+
+    if (argc == 3 && strcmp(argv[1], "stats") == 0 && strcmp(argv[2], "reset") == 0) {
+        sphinx_stats_reset();
+        puts("sphinx: statistics reset");
+        return 0;
+    }
+
+    if (argc >= 5 && argc <= 6 && strcmp(argv[1], "pki") == 0 && strcmp(argv[2], "add") == 0) {
+
+        ipv6_addr_t addr;
+        unsigned char public_key[KEY_SIZE];
+        unsigned char private_key[KEY_SIZE];
+
+        /* keys of a running server must not change */
+        if (sphinx_pid) {
+            puts("error: stop sphinx before changing the pki");
+            return 1;
+        }
+
+        if (ipv6_addr_from_str(&addr, argv[3]) == NULL) {
+            puts("error: ipv6 address malformed");
+            return 1;
+        }
+
+        if (parse_hex_key(public_key, argv[4]) < 0 || (argc == 6 && parse_hex_key(private_key, argv[5]) < 0)) {
+            puts("error: keys must be 64 hex digits");
+            return 1;
+        }
+
+        return sphinx_pki_add(&addr, public_key, argc == 6 ? private_key : NULL) < 0;
+    }
+
+    if (argc == 5 && strcmp(argv[1], "pki") == 0 && strcmp(argv[2], "weight") == 0) {
+
+        ipv6_addr_t addr;
+
+        if (sphinx_pid) {
+            puts("error: stop sphinx before changing the pki");
+            return 1;
+        }
+
+        if (ipv6_addr_from_str(&addr, argv[3]) == NULL || sphinx_pki_set_weight(&addr, strtoul(argv[4], NULL, 10)) < 0) {
+            puts("error: address not found in pki");
+            return 1;
+        }
+
+        return 0;
+    }
+
+    #ifdef CPU_NATIVE
+    if (argc == 4 && strcmp(argv[1], "pki") == 0 && strcmp(argv[2], "load") == 0) {
+        if (sphinx_pid) {
+            puts("error: stop sphinx before changing the pki");
+            return 1;
+        }
+        if (sphinx_pki_load_file(argv[3]) < 0) {
+            return 1;
+        }
+        printf("sphinx: %lu nodes in pki\n", (unsigned long) sphinx_pki_count());
+        return 0;
+    }
+    #endif /* CPU_NATIVE */
+
+    #if SPHINX_BENCH
+    if (argc >= 2 && argc <= 3 && strcmp(argv[1], "bench") == 0) {
+        /* benchmark messages must not mix with the messages of the server */
+        if (sphinx_pid) {
+            puts("error: stop sphinx before running the benchmark");
+            return 1;
+        }
+        return sphinx_bench(argc == 3 ? strtoul(argv[2], NULL, 10) : 0) < 0;
+    }
+    #endif /* SPHINX_BENCH */
+
+    #if SPHINX_SIM
+    if (argc >= 3 && argc <= 5 && strcmp(argv[1], "sim") == 0) {
+        /* simulated nodes share the state of sent messages with the server */
+        if (sphinx_pid) {
+            puts("error: stop sphinx before running the simulation");
+            return 1;
+        }
+        return sphinx_sim(strtoul(argv[2], NULL, 10), argc >= 4 ? strtoul(argv[3], NULL, 10) : 0,
+                          argc == 5 ? strtoul(argv[4], NULL, 10) : 0) < 0;
+    }
+    #endif /* SPHINX_SIM */
+
     if (argc == 4 && strcmp(argv[1], "send") == 0) {
 
+        /* address of message destination */
+        ipv6_addr_t dest_addr;
+
         if (!sphinx_pid) {
             puts("error: sphinx not running\nusage: sphinx start");
             return 1;
@@ -55,23 +217,38 @@ int sphinx_cmd(int argc, char **argv)
         }
 
         /* check data length */
-        if (strlen(argv[3]) > PAYLOAD_SIZE) {
-            printf("error: data input too big\nPAYLOAD_SIZE = %d\n", PAYLOAD_SIZE);
+        if (strlen(argv[3]) > SPHINX_MAX_TRANSFER_SIZE) {
+            printf("error: data input too big\nSPHINX_MAX_TRANSFER_SIZE = %d\n", SPHINX_MAX_TRANSFER_SIZE);
             return 1;
         }
 
-        /* set event for sendig a message */
-        sphinx_send = (event_send) {.handler = handle_send, .transmit_count = 0, .dest_addr = dest_addr, .data = argv[3], .data_len = strlen(argv[3])};
-
-        event_post(&sphinx_queue, (event_t *) &sphinx_send);
-
+        /* queue message, the payload is copied */
+        if (sphinx_send_async(&dest_addr, argv[3], strlen(argv[3]), NULL) < 0) {
+            puts("error: can't send message, waiting for too many replies");
+            return 1;
+        }
 
         return 0;
     }
 
     puts("sphinx: invalid command");
-    puts("usage: sphinx [start|stop]");
+    puts("usage: sphinx [start|stop|selftest|mem]");
+    puts("usage: sphinx epoch [<epoch>]");
+    puts("usage: sphinx stats [reset]");
+    puts("usage: sphinx batch [<messages per wakeup>]");
+    puts("usage: sphinx mix [<flush threshold>]");
     puts("usage: sphinx send <addr> <data>");
+    puts("usage: sphinx pki [add <addr> <public key> [<private key>]]");
+    puts("usage: sphinx pki weight <addr> <weight>");
+    #ifdef CPU_NATIVE
+    puts("usage: sphinx pki load <file>");
+    #endif /* CPU_NATIVE */
+    #if SPHINX_BENCH
+    puts("usage: sphinx bench [<iterations>]");
+    #endif /* SPHINX_BENCH */
+    #if SPHINX_SIM
+    puts("usage: sphinx sim <messages> [<window> [<nodes>]]");
+    #endif /* SPHINX_SIM */
 
     return 1;
 
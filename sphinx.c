@@ -3,20 +3,16 @@
 /* idicator if sphinx thread is running */
 kernel_pid_t sphinx_pid = 0;
 
-char sphinx_server_stack[THREAD_STACKSIZE_MAIN];
+char sphinx_server_stack[SPHINX_STACK_SIZE];
 
-/* stores random bytes from stream cipher */
-unsigned char prg_stream[PRG_STREAM_SIZE];
+/* epoch keys of this node and the tags seen under them to prevent replay attacks */
+sphinx_keyring keyring;
 
-/* stores created and received sphinx messages */
-unsigned char sphinx_message[SPHINX_MESSAGE_SIZE];
+/* sends sphinx messages, replaced to keep them on this node */
+sphinx_transport_t sphinx_transport = udp_send;
 
-/* array to store seen message tags to prevent replay attacks */
-unsigned char tag_table[TAG_TABLE_LEN][TAG_SIZE];
-uint8_t tag_count = 0;
-
-/* event queue for sphinx thread */
-event_queue_t sphinx_queue;
+/* event queues for sphinx thread, forwarding goes before local sends */
+event_queue_t sphinx_queues[SPHINX_PRIO_COUNT];
 
 /* ipv6 address of this node */
 ipv6_addr_t local_addr;
@@ -24,98 +20,384 @@ ipv6_addr_t local_addr;
 /* socket to receive sphinx messages */
 sock_udp_t sock;
 
-/* stores sent messages */
-event_send sent_msg_table[SENT_MSG_TABLE_SIZE];
-uint8_t sent_msg_count = 0;
-
 /* mutex for variables storing state of sent messages */
 mutex_t sent_msg_mutex = MUTEX_INIT;
 
+/* fires when the earliest sent message is due for retransmit or discard */
+event_t retransmit_event = { .handler = handle_retransmit };
+event_timeout_t retransmit_timeout;
+
+/* datagrams processed per wakeup before other events get their turn, set with 'sphinx batch' */
+uint8_t sphinx_recv_batch = SPHINX_RECV_BATCH;
+
+/* continues draining the socket after a full batch */
+static void handle_recv(event_t *event);
+static event_t recv_event = { .handler = handle_recv };
+
+/* arms the retransmit timer to the earliest deadline of sent messages */
+static void schedule_retransmit(void)
+{
+    uint32_t deadline;
+    int32_t delay;
+
+    if (inflight_next_deadline(&deadline) < 0) {
+        event_timeout_clear(&retransmit_timeout);
+        return;
+    }
+
+    delay = deadline - ztimer_now(ZTIMER_MSEC);
+    event_timeout_set(&retransmit_timeout, delay > 0 ? delay : 0);
+}
+
+/* takes a context, a header build of the idle time gives its context up for sent and received messages */
+static sphinx_ctx *ctx_alloc(void)
+{
+    sphinx_ctx *ctx;
+
+    if ((ctx = sphinx_ctx_alloc()) == NULL && sphinx_precomp_cancel() > 0) {
+        ctx = sphinx_ctx_alloc();
+    }
+
+    return ctx;
+}
+
+/* releases a message that will not be sent anymore, sent ones leave the table of sent messages too */
+static void drop_send(event_send *sphinx_send)
+{
+    if (sphinx_send->ctx != NULL) {
+        sphinx_ctx_free(sphinx_send->ctx);
+        sphinx_send->ctx = NULL;
+    }
+    sphinx_send->queued = 0;
+
+    if (sphinx_send->transmit_count == 0 || sphinx_send->acked) {
+        inflight_free(sphinx_send);
+    } else {
+        inflight_remove(sphinx_send->id);
+    }
+}
+
 void handle_stop(event_t *event)
 {
     (void) event;
+    event_timeout_clear(&retransmit_timeout);
+    event_cancel(&sphinx_queues[SPHINX_PRIO_NETWORK], &recv_event);
+
+    /* messages under or waiting for creation are dropped with their descriptors */
+    while ((event = event_get(&sphinx_queues[SPHINX_PRIO_CREATE])) != NULL ||
+           (event = event_get(&sphinx_queues[SPHINX_PRIO_SEND])) != NULL) {
+        drop_send((event_send *) event);
+    }
+
+    /* release the context of a header build */
+    sphinx_precomp_cancel();
+    while (event_get(&sphinx_queues[SPHINX_PRIO_IDLE]) != NULL) {}
+
+    /* messages in the mix pool are sent before the thread stops */
+    sphinx_mix_flush();
     sock_udp_close(&sock);
     thread_zombify();
 }
 
+/* starts the creation of a message, returns 1 if a pre-built header completed it at once */
+static int8_t start_message(event_send *sphinx_send, sphinx_ctx *ctx)
+{
+    /* use a pre-built header on first transmit, retransmits keep their id */
+    if (sphinx_send->transmit_count == 0 &&
+        sphinx_precomp_take(ctx, sphinx_send->id, &sphinx_send->dest_addr, sphinx_send->data, sphinx_send->data_len) > 0) {
+        return 1;
+    }
+
+    /* else set random id */
+    if (sphinx_send->transmit_count == 0) {
+        random_bytes(sphinx_send->id, ID_SIZE);
+    }
+
+    return sphinx_create_begin(ctx, sphinx_send->data_len) < 0 ? -1 : 0;
+}
+
 void handle_send(event_t *event)
 {
     event_send *sphinx_send = (event_send *) event;
 
-    /* check if this is the first transmitt */
-    if (sphinx_send->transmit_count == 0) {
-        /* check if message can be sent */
-        if (sent_msg_count >=  SENT_MSG_TABLE_SIZE) {
-            puts("error: can't send message, waiting for too many replies");
-            return;
+    /* buffers the message is created in, kept between the steps */
+    sphinx_ctx *ctx = sphinx_send->ctx;
+
+    int8_t res;
+
+    /* acknowledged while waiting for its retransmit */
+    if (sphinx_send->acked) {
+        if (ctx != NULL) {
+            sphinx_ctx_free(ctx);
         }
-        /* else set random id */
-        random_bytes(sphinx_send->id, ID_SIZE);
+        inflight_free(sphinx_send);
+        return;
     }
 
-    /* set destination addres to recipient */
-    memcpy(&dest_addr, &sphinx_send->dest_addr, ADDR_SIZE);
+    /* runs one step of message creation per event */
+    if (ctx == NULL) {
+        sphinx_send->create_start = STATS_NOW();
+        ctx = ctx_alloc();
+        res = ctx != NULL ? start_message(sphinx_send, ctx) : -1;
+    } else {
+        res = sphinx_create_step(ctx, sphinx_send->id, &sphinx_send->dest_addr, sphinx_send->data, sphinx_send->data_len);
+    }
+
+    /* the next step waits for the received messages, new messages wait for this one */
+    if (res == 0) {
+        sphinx_send->ctx = ctx;
+        event_post(&sphinx_queues[SPHINX_PRIO_CREATE], event);
+        return;
+    }
 
-    /* create sphinx message */
-    if ((sphinx_create_message(sphinx_message, sphinx_send->id, &dest_addr, sphinx_send->data, sphinx_send->data_len)) < 0) {
+    sphinx_send->ctx = NULL;
+    sphinx_send->queued = 0;
+
+    if (res < 0) {
+        if (ctx != NULL) {
+            sphinx_ctx_free(ctx);
+        }
         puts("error: could not create sphinx message");
+
+        /* failed retransmits count too, so the message is discarded eventually */
+        if (sphinx_send->transmit_count > 0) {
+            sphinx_send->transmit_count++;
+            sphinx_send->timestamp = ztimer_now(ZTIMER_MSEC);
+            inflight_reschedule(sphinx_send);
+        } else {
+            inflight_free(sphinx_send);
+        }
         return;
     }
 
-    /* send sphinx message */
-    udp_send(&dest_addr, sphinx_message, SPHINX_MESSAGE_SIZE);
+    /* includes the received messages processed between the steps */
+    STATS_TIME(create, STATS_NOW() - sphinx_send->create_start);
+
+    /* send sphinx message to first hop */
+    sphinx_transport(&ctx->dest_addr, ctx->message, ctx->cls->message_size);
+    sphinx_ctx_free(ctx);
 
     /* adjust the event properties */
     sphinx_send->transmit_count++;
-    sphinx_send->timestamp = xtimer_now_usec();
+    sphinx_send->timestamp = ztimer_now(ZTIMER_MSEC);
 
     /* verbose */
     print_id(sphinx_send->id);
     if (sphinx_send->transmit_count == 1) {
+        STATS_COUNT(sent);
         puts("message sent");
-        /* add message to sent message table */
-        memcpy(&sent_msg_table[sent_msg_count], sphinx_send, sizeof(event_send));
-        sent_msg_count++;
+        /* add message to sent messages */
+        inflight_insert(sphinx_send);
+        schedule_retransmit();
     } else {
+        STATS_COUNT(retransmitted);
         puts("message retransmitted");
+        inflight_reschedule(sphinx_send);
     }
 }
 
-void handle_socket(sock_udp_t *sock, sock_async_flags_t type, void *node_self)
+int8_t sphinx_send_async(ipv6_addr_t *dest_addr, const char *data, size_t data_len, send_handle *handle)
 {
-    ssize_t res;
+    event_send *fragments[SPHINX_MAX_FRAGMENTS];
+    uint8_t count = data_len > FRAGMENT_DATA_SIZE ? (data_len + FRAGMENT_DATA_SIZE - 1) / FRAGMENT_DATA_SIZE : 1;
+    uint32_t transfer;
+    size_t offset;
 
-    if (type == SOCK_ASYNC_MSG_RECV) {
+    if (!sphinx_pid || data_len > SPHINX_MAX_TRANSFER_SIZE) {
+        return -1;
+    }
+
+    /* every fragment takes a descriptor that owns a copy of its part of the payload */
+    for (uint8_t i=0; i<count; i++) {
+        if ((fragments[i] = inflight_alloc()) == NULL) {
+            while (i > 0) {
+                inflight_free(fragments[--i]);
+            }
+            return -1;
+        }
+    }
+
+    transfer = inflight_new_transfer();
+
+    for (uint8_t i=0; i<count; i++) {
+        event_send *sphinx_send = fragments[i];
+
+        offset = i * FRAGMENT_DATA_SIZE;
+
+        sphinx_send->handler = handle_send;
+        sphinx_send->transmit_count = 0;
+        sphinx_send->dest_addr = *dest_addr;
+        sphinx_send->transfer = transfer;
+        memset(sphinx_send->data, 0, PAYLOAD_SIZE);
+        sphinx_send->data_len = fragment_encode((unsigned char *) sphinx_send->data, transfer, i, count, &data[offset],
+                                                data_len - offset < FRAGMENT_DATA_SIZE ? data_len - offset : FRAGMENT_DATA_SIZE);
+
+        /* fragments of one transfer all use the largest size class */
+        if (count > 1) {
+            sphinx_send->data_len = PAYLOAD_SIZE;
+        }
+
+        sphinx_send->queued = 1;
+    }
+
+    if (handle != NULL) {
+        *handle = transfer;
+    }
+
+    /* event queues take events from any thread */
+    for (uint8_t i=0; i<count; i++) {
+        event_post(&sphinx_queues[SPHINX_PRIO_SEND], (event_t *) fragments[i]);
+    }
+
+    return 1;
+}
 
-        res = sock_udp_recv(sock, sphinx_message, SPHINX_MESSAGE_SIZE, 0, NULL);
+int8_t sphinx_send_pending(send_handle handle)
+{
+    return inflight_transfer_pending(handle);
+}
+
+void handle_retransmit(event_t *event)
+{
+    (void) event;
+
+    /* sent message waiting for an acknowledgement */
+    event_send *msg;
+
+    uint32_t now = ztimer_now(ZTIMER_MSEC);
+
+    /* check status of sent messages whose timeout was exceeded */
+    while ((msg = inflight_next_expired(now)) != NULL) {
+
+        /* check if maximum transmis of message are reached */
+        if (msg->transmit_count >= MAX_TRANSMITS) {
+            STATS_COUNT(discarded);
+            print_id(msg->id);
+            puts("message discarded");
+
+            /* delete message */
+            inflight_remove(msg->id);
+            continue;
+        }
+
+        /* retransmit message after the messages created before it, its timeout restarts meanwhile */
+        msg->timestamp = now;
+        inflight_reschedule(msg);
+        if (!msg->queued) {
+            msg->queued = 1;
+            event_post(&sphinx_queues[SPHINX_PRIO_SEND], (event_t *) msg);
+        }
+    }
+
+    schedule_retransmit();
+}
+
+/* processes pending datagrams back to back, returns how many were taken from the socket */
+static uint8_t recv_batch(sock_udp_t *sock, sphinx_keyring *keyring)
+{
+    ssize_t res = 0;
+    uint8_t count = 0;
+
+    /* size class of the received message */
+    const sphinx_class *cls;
+
+    /* drop keys and seen tags of expired epochs */
+    sphinx_keyring_update(keyring);
+
+    #if SPHINX_ZERO_COPY_RECV
+    /* message in the packet buffer of the network stack */
+    void *message;
+    void *buf_ctx = NULL;
+
+    while (count < sphinx_recv_batch) {
+
+        /* process and forward the message in place, the next call releases the packet buffer */
+        while ((res = sock_udp_recv_buf(sock, &message, &buf_ctx, 0, NULL)) > 0) {
+
+            if ((cls = sphinx_class_for_message(res)) == NULL) {
+                puts("sphinx: received malformed data");
+                continue;
+            }
+
+            if (sphinx_process_message(message, cls, keyring) < 0) {
+                puts("sphinx: could not process sphinx message");
+            }
+        }
 
         if (res < 0) {
-            printf("sphinx: error receiving data, code %d\n", res);
-            return;
+            break;
         }
-        
-        if (res != SPHINX_MESSAGE_SIZE) {
-            puts("sphinx: received malformed data");
-            return;
+        count++;
+    }
+    #else
+    /* buffer to receive the messages of the batch in */
+    sphinx_ctx *ctx;
+
+    /* leave the messages queued until a context is free */
+    if ((ctx = ctx_alloc()) == NULL) {
+        return 0;
+    }
+
+    while (count < sphinx_recv_batch) {
+
+        if ((res = sock_udp_recv(sock, ctx->message, SPHINX_MESSAGE_SIZE, 0, NULL)) < 0) {
+            break;
         }
+        count++;
 
-        if (sphinx_process_message(sphinx_message, (network_node *) node_self, tag_table, &tag_count) < 0) {
+        if ((cls = sphinx_class_for_message(res)) == NULL) {
+            puts("sphinx: received malformed data");
+        } else if (sphinx_process_message(ctx->message, cls, keyring) < 0) {
             puts("sphinx: could not process sphinx message");
         }
     }
+
+    sphinx_ctx_free(ctx);
+    #endif /* SPHINX_ZERO_COPY_RECV */
+
+    /* an empty socket ends the batch */
+    if (res < 0 && res != -EAGAIN) {
+        printf("sphinx: error receiving data, code %d\n", (int) res);
+    }
+
+    if (count > 0) {
+        STATS_COUNT(recv_batches);
+
+        /* acknowledgements may have removed the earliest sent message */
+        schedule_retransmit();
+    }
+
+    /* a full batch may have left datagrams behind, drain them after the events queued meanwhile */
+    if (count == sphinx_recv_batch) {
+        event_post(&sphinx_queues[SPHINX_PRIO_NETWORK], &recv_event);
+    }
+
+    return count;
+}
+
+static void handle_recv(event_t *event)
+{
+    (void) event;
+    recv_batch(&sock, &keyring);
+}
+
+void handle_socket(sock_udp_t *sock, sock_async_flags_t type, void *keyring)
+{
+    if (type == SOCK_ASYNC_MSG_RECV) {
+        recv_batch(sock, (sphinx_keyring *) keyring);
+    }
 }
 
 void* sphinx(void *arg)
 {
     (void) arg;
 
-    /* used to store time variable */
-    uint32_t now;
-
     event_t *event;
 
     network_node *node_self;
 
+    const unsigned char *private_key;
+
     sock_udp_ep_t local = SOCK_IPV6_EP_ANY;
     local.port = SPHINX_PORT;
 
@@ -128,6 +410,12 @@ void* sphinx(void *arg)
         return NULL;
     }
 
+    /* the compiled in pki holds public keys only */
+    if ((private_key = sphinx_pki_private_key()) == NULL) {
+        puts("error: no private key of this node, build with SPHINX_PRIVATE_KEY or add it with 'sphinx pki add'");
+        return NULL;
+    }
+
     /* print ipv6 address */
     puts("sphinx: server running at address");
     print_hex_memory(&local_addr, sizeof(ipv6_addr_t));
@@ -137,48 +425,63 @@ void* sphinx(void *arg)
         return NULL;
     }
 
-    event_queue_init(&sphinx_queue);
+    sphinx_keyring_init(&keyring, node_self, private_key);
 
-    /* makes socket create events for asynchronous access */
-    sock_udp_event_init(&sock, &sphinx_queue, handle_socket, node_self);
+    event_queues_init(sphinx_queues, SPHINX_PRIO_COUNT);
 
-    while(1) {
+    /* retransmits are posted to the queue when due, so the thread sleeps while idle */
+    event_timeout_ztimer_init(&retransmit_timeout, ZTIMER_MSEC, &sphinx_queues[SPHINX_PRIO_LOCAL], &retransmit_event);
+    sphinx_mix_init(&sphinx_queues[SPHINX_PRIO_NETWORK]);
+    sphinx_precomp_init(&sphinx_queues[SPHINX_PRIO_IDLE]);
 
-        /* wait for event with timeout */
-        if ((event = event_wait_timeout(&sphinx_queue, EVENT_TIMEOUT_US))) {
-            event->handler(event);
-        }
-
-        
-        now = xtimer_now_usec();
-
-        /* check status of sent messages */
-        for (uint8_t i=0; i<sent_msg_count; i++) {
-
-            /* check if timeout was exceeded */
-            if ((now - sent_msg_table[i].timestamp) < MSG_TIMEOUT_US) {
-                continue;
-            }
+    /* makes socket create events for asynchronous access */
+    sock_udp_event_init(&sock, &sphinx_queues[SPHINX_PRIO_NETWORK], handle_socket, &keyring);
 
-            /* check if maximum transmis of message are reached */
-            if (sent_msg_table[i].transmit_count >= MAX_TRANSMITS) {
-                print_id(sent_msg_table[i].id);
-                puts("message discarded");
+    while(1) {
 
-                /* delete message */
-                memmove(&sent_msg_table[i], &sent_msg_table[i+1], (SENT_MSG_TABLE_SIZE - i) * sizeof(event_send));
-                sent_msg_count--;
-                break;
-            }
+        /* the queue with the lowest index goes first, headers are pre-built on the last one */
+        event = event_wait_multi(sphinx_queues, SPHINX_PRIO_COUNT);
+        STATS_COUNT(wakeups);
 
-            /* retransmit message */
-            handle_send((event_t *) &sent_msg_table[i]);
-        }
+        event->handler(event);
     }
 
     return NULL;
 }
 
+/* static memory of the buffers the footprint profile sizes, and the stack use of the thread */
+void sphinx_mem_print(void)
+{
+    size_t total = sizeof(sphinx_server_stack) + sizeof(keyring) + sphinx_ctx_ram() + inflight_ram() +
+                   sphinx_precomp_ram() + sphinx_mix_ram() + fragment_ram();
+
+    #if SPHINX_STATS
+    total += sizeof(sphinx_stats);
+    #endif /* SPHINX_STATS */
+
+    printf("sphinx: profile %s, %lu bytes of static memory\n", SPHINX_PROFILE, (unsigned long) total);
+    printf("sphinx: stack %lu keyring %lu contexts %lu inflight %lu\n",
+           (unsigned long) sizeof(sphinx_server_stack), (unsigned long) sizeof(keyring),
+           (unsigned long) sphinx_ctx_ram(), (unsigned long) inflight_ram());
+    printf("sphinx: precomp %lu mix pool %lu reassembly %lu\n",
+           (unsigned long) sphinx_precomp_ram(), (unsigned long) sphinx_mix_ram(), (unsigned long) fragment_ram());
+
+    #if SPHINX_STATS
+    printf("sphinx: stats %lu\n", (unsigned long) sizeof(sphinx_stats));
+    #endif /* SPHINX_STATS */
+
+    #ifdef DEVELHELP
+    /* the thread is created with THREAD_CREATE_STACKTEST, the same measurement as 'ps' */
+    thread_t *thread;
+
+    if (sphinx_pid && (thread = thread_get(sphinx_pid)) != NULL) {
+        printf("sphinx: peak stack use %lu of %lu bytes\n",
+               (unsigned long) (thread_get_stacksize(thread) - thread_measure_stack_free(thread)),
+               (unsigned long) thread_get_stacksize(thread));
+    }
+    #endif /* DEVELHELP */
+}
+
 /* starts the sphinx server thread */
 int8_t sphinx_start(void)
 {   
@@ -0,0 +1,566 @@
+#include "shpinx.h"
+
+#if SPHINX_BENCH
+
+enum {
+    BENCH_FORWARD,
+    BENCH_RECEIVE,
+    BENCH_REPLY,
+    BENCH_BRANCHES
+};
+
+/* one row per creation step and one for the longest step of a message */
+#define BENCH_ROWS (SPHINX_STEP_PAYLOAD + 2)
+
+/* operations timed together where a single one is below the timer resolution */
+#define BENCH_REPEAT 100
+
+/* generated nodes the benchmark messages run through, as many as in the test network */
+#define BENCH_NODES 6
+
+/* timings of the current benchmark case in microseconds, one row per processing branch or creation step */
+static uint32_t samples[BENCH_ROWS][SPHINX_BENCH_ITERATIONS];
+
+/* keys of the node a message is processed at */
+static sphinx_keyring bench_keyring;
+
+/* private keys of the generated nodes, in the order of the pki */
+static unsigned char bench_keys[BENCH_NODES][KEY_SIZE];
+
+/* last message passed to the transport */
+static unsigned char captured_message[SPHINX_MESSAGE_SIZE];
+static size_t captured_size;
+static ipv6_addr_t captured_addr;
+static uint8_t captured;
+
+static int8_t capture_send(ipv6_addr_t *dest_addr, unsigned char *message, size_t message_size)
+{
+    memcpy(&captured_addr, dest_addr, ADDR_SIZE);
+    memcpy(captured_message, message, message_size);
+    captured_size = message_size;
+    captured = 1;
+    return 1;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* prints one csv line: name, path lengths, count, mean, p50, p99 and ops per second */
+static void report(const char *name, uint32_t *times, uint8_t path_len_dest, uint8_t path_len_reply, uint16_t count)
+{
+    uint64_t sum = 0;
+
+    if (count == 0) {
+        return;
+    }
+
+    qsort(times, count, sizeof(uint32_t), compare_samples);
+
+    for (uint16_t i=0; i<count; i++) {
+        sum += times[i];
+    }
+
+    printf("bench,%s,%u,%u,%u,%lu,%lu,%lu,%lu\n", name, path_len_dest, path_len_reply, count,
+           (unsigned long) (sum / count), (unsigned long) times[count / 2], (unsigned long) times[(count - 1) * 99 / 100],
+           (unsigned long) (sum ? (uint64_t) count * 1000000 / sum : 0));
+}
+
+static int8_t bench_create(ipv6_addr_t *dest_addr, uint16_t iterations)
+{
+    unsigned char shared_secrets[2*SPHINX_MAX_PATH][KEY_SIZE];
+    unsigned char id[ID_SIZE];
+    char data[PAYLOAD_SIZE] = "bench";
+    sphinx_ctx *ctx;
+    uint32_t start;
+    char name[32];
+
+    if ((ctx = sphinx_ctx_alloc()) == NULL) {
+        return -1;
+    }
+
+    /* one run per size class, named after the message size */
+    for (uint8_t c=0; c<SPHINX_CLASS_COUNT; c++) {
+        ctx->cls = &sphinx_classes[c];
+        snprintf(name, sizeof(name), "create_message_%u", ctx->cls->message_size);
+
+        for (uint8_t path_len_dest=3; path_len_dest<=ctx->cls->max_path; path_len_dest++) {
+            for (uint8_t path_len_reply=3; path_len_reply<=ctx->cls->max_path; path_len_reply++) {
+                for (uint16_t i=0; i<iterations; i++) {
+                    random_bytes(id, ID_SIZE);
+
+                    start = ztimer_now(ZTIMER_USEC);
+                    if (sphinx_create_header(ctx, shared_secrets, path_len_dest, path_len_reply, id, dest_addr) < 0) {
+                        sphinx_ctx_free(ctx);
+                        return -1;
+                    }
+                    sphinx_seal_payload(ctx, shared_secrets, path_len_dest, data, ctx->cls->payload_size);
+                    samples[0][i] = ztimer_now(ZTIMER_USEC) - start;
+                }
+                report(name, samples[0], path_len_dest, path_len_reply, iterations);
+            }
+        }
+    }
+
+    sphinx_ctx_free(ctx);
+    return 1;
+}
+
+/* time of each creation step at the longest paths, the longest step bounds how long other events wait */
+static int8_t bench_steps(ipv6_addr_t *dest_addr, uint16_t iterations)
+{
+    static const char *step_names[] = { "create_step_path", "create_step_secrets", "create_step_header",
+                                         "create_step_surb", "create_step_payload", "create_step_max" };
+    unsigned char id[ID_SIZE];
+    char data[PAYLOAD_SIZE] = "bench";
+    sphinx_ctx *ctx;
+    uint32_t start;
+    uint32_t elapsed;
+    uint8_t step;
+    int8_t res;
+
+    if ((ctx = sphinx_ctx_alloc()) == NULL) {
+        return -1;
+    }
+
+    for (uint8_t c=0; c<SPHINX_CLASS_COUNT; c++) {
+        for (uint16_t i=0; i<iterations; i++) {
+            random_bytes(id, ID_SIZE);
+            sphinx_create_begin(ctx, sphinx_classes[c].payload_size);
+            ctx->path_len_dest = ctx->cls->max_path;
+            ctx->path_len_reply = ctx->cls->max_path;
+            samples[BENCH_ROWS - 1][i] = 0;
+
+            do {
+                step = ctx->step;
+                start = ztimer_now(ZTIMER_USEC);
+                res = sphinx_create_step(ctx, id, dest_addr, data, ctx->cls->payload_size);
+                elapsed = ztimer_now(ZTIMER_USEC) - start;
+
+                if (res < 0) {
+                    sphinx_ctx_free(ctx);
+                    return -1;
+                }
+                samples[step][i] = elapsed;
+                if (elapsed > samples[BENCH_ROWS - 1][i]) {
+                    samples[BENCH_ROWS - 1][i] = elapsed;
+                }
+            } while (res == 0);
+        }
+
+        for (uint8_t row=0; row<BENCH_ROWS; row++) {
+            report(step_names[row], samples[row], sphinx_classes[c].max_path, sphinx_classes[c].max_path, iterations);
+        }
+    }
+
+    sphinx_ctx_free(ctx);
+    return 1;
+}
+
+/* sends one message along its whole path and back, timing every hop by branch */
+static int8_t route_message(sphinx_ctx *ctx, ipv6_addr_t *dest_addr, uint16_t counts[])
+{
+    unsigned char shared_secrets[2*SPHINX_MAX_PATH][KEY_SIZE];
+    unsigned char id[ID_SIZE];
+    char data[PAYLOAD_SIZE] = {0};
+    uint8_t path_len_dest = sphinx_random_path_len(ctx->cls);
+    event_send *msg;
+    ipv6_addr_t next_hop;
+    uint8_t k;
+    uint8_t branch;
+    uint32_t start;
+
+    /* the reply is only accepted for a message waiting for an acknowledgement */
+    if ((msg = inflight_alloc()) == NULL) {
+        return -1;
+    }
+    random_bytes(id, ID_SIZE);
+    memcpy(msg->id, id, ID_SIZE);
+    fragment_encode((unsigned char *) data, 1, 0, 1, "bench", 5);
+    msg->transmit_count = 1;
+    msg->timestamp = ztimer_now(ZTIMER_MSEC);
+    inflight_insert(msg);
+
+    if (sphinx_create_header(ctx, shared_secrets, path_len_dest, sphinx_random_path_len(ctx->cls), id, dest_addr) < 0) {
+        inflight_remove(id);
+        return -1;
+    }
+    sphinx_seal_payload(ctx, shared_secrets, path_len_dest, data, ctx->cls->payload_size);
+    next_hop = ctx->dest_addr;
+
+    for (uint8_t hop=0; ; hop++) {
+        for (k=0; k<BENCH_NODES && !ipv6_addr_equal(&sphinx_pki_node(k)->addr, &next_hop); k++);
+        if (k == BENCH_NODES) {
+            break;
+        }
+        sphinx_keyring_init(&bench_keyring, sphinx_pki_node(k), bench_keys[k]);
+
+        if (hop < path_len_dest - 1) {
+            branch = BENCH_FORWARD;
+        } else if (hop == path_len_dest - 1) {
+            branch = BENCH_RECEIVE;
+        } else if (ipv6_addr_equal(&next_hop, &local_addr)) {
+            branch = BENCH_REPLY;
+        } else {
+            branch = BENCH_FORWARD;
+        }
+
+        sphinx_keyring_update(&bench_keyring);
+        captured = 0;
+        start = ztimer_now(ZTIMER_USEC);
+        if (sphinx_process_message(ctx->message, ctx->cls, &bench_keyring) < 0) {
+            break;
+        }
+        if (counts[branch] < SPHINX_BENCH_ITERATIONS) {
+            samples[branch][counts[branch]++] = ztimer_now(ZTIMER_USEC) - start;
+        }
+
+        /* acknowledgement reached this node */
+        if (!captured) {
+            return 1;
+        }
+
+        memcpy(ctx->message, captured_message, captured_size);
+        next_hop = captured_addr;
+    }
+
+    inflight_remove(id);
+    return -1;
+}
+
+static int8_t bench_process(ipv6_addr_t *dest_addr, uint16_t iterations)
+{
+    uint16_t counts[BENCH_BRANCHES] = {0};
+    sphinx_ctx *ctx;
+    int8_t res = 1;
+
+    if ((ctx = sphinx_ctx_alloc()) == NULL) {
+        return -1;
+    }
+
+    for (uint16_t i=0; i<iterations; i++) {
+        if ((res = route_message(ctx, dest_addr, counts)) < 0) {
+            break;
+        }
+    }
+
+    sphinx_ctx_free(ctx);
+
+    report("process_forward", samples[BENCH_FORWARD], 0, 0, counts[BENCH_FORWARD]);
+    report("process_receive", samples[BENCH_RECEIVE], 0, 0, counts[BENCH_RECEIVE]);
+    report("process_reply", samples[BENCH_REPLY], 0, 0, counts[BENCH_REPLY]);
+
+    return res;
+}
+
+static void bench_helpers(uint16_t iterations)
+{
+    unsigned char shared_secrets[2*SPHINX_MAX_PATH][KEY_SIZE];
+    unsigned char stream_keys[SPHINX_MAX_PATH][KEY_SIZE];
+    unsigned char header_streams[SPHINX_MAX_PATH][HEADER_STREAM_SIZE];
+    unsigned char *node_keys[2*SPHINX_MAX_PATH];
+    network_node *path_nodes[2*SPHINX_MAX_PATH];
+    unsigned char message[SPHINX_MESSAGE_SIZE];
+    unsigned char routing_and_mac[MAC_SIZE + ENC_ROUTING_SIZE];
+    unsigned char id[ID_SIZE] = {0};
+    uint32_t epoch = sphinx_current_epoch();
+    uint32_t start;
+
+    for (uint8_t i=0; i<2*SPHINX_MAX_PATH; i++) {
+        path_nodes[i] = sphinx_pki_node(i % sphinx_pki_count());
+        node_keys[i] = get_epoch_public_key(path_nodes[i], epoch);
+    }
+
+    /* both derivations up to the secrets of a message and its reply on the longest paths */
+    for (uint8_t path_len=3; path_len<=2*SPHINX_MAX_PATH; path_len++) {
+        for (uint8_t linear=0; linear<2; linear++) {
+            for (uint16_t i=0; i<iterations; i++) {
+                start = ztimer_now(ZTIMER_USEC);
+                calculate_shared_secrets(message, shared_secrets, node_keys, path_len, NULL, linear);
+                samples[0][i] = ztimer_now(ZTIMER_USEC) - start;
+            }
+            report(linear ? "calculate_shared_secrets_linear" : "calculate_shared_secrets_nested", samples[0], path_len, 0, iterations);
+        }
+    }
+
+    for (uint8_t path_len=3; path_len<=SPHINX_MAX_PATH; path_len++) {
+        calculate_shared_secrets(message, shared_secrets, node_keys, path_len, NULL, SPHINX_LINEAR_SECRETS);
+
+        for (uint8_t i=0; i<path_len; i++) {
+            derive_stream_key(stream_keys[i], nonce, shared_secrets[i]);
+        }
+
+        for (uint16_t i=0; i<iterations; i++) {
+            start = ztimer_now(ZTIMER_USEC);
+            generate_header_streams(SPHINX_LARGEST_CLASS, header_streams, stream_keys, path_len);
+            samples[0][i] = ztimer_now(ZTIMER_USEC) - start;
+        }
+        report("generate_header_streams", samples[0], path_len, 0, iterations);
+
+        for (uint16_t i=0; i<iterations; i++) {
+            memset(routing_and_mac, 0, sizeof(routing_and_mac));
+            start = ztimer_now(ZTIMER_USEC);
+            calculate_nodes_padding(SPHINX_LARGEST_CLASS, &routing_and_mac[MAC_SIZE], header_streams, path_len);
+            samples[0][i] = ztimer_now(ZTIMER_USEC) - start;
+        }
+        report("calculate_nodes_padding", samples[0], path_len, 0, iterations);
+
+        for (uint16_t i=0; i<iterations; i++) {
+            start = ztimer_now(ZTIMER_USEC);
+            encapsulate_routing_and_mac(SPHINX_LARGEST_CLASS, routing_and_mac, shared_secrets, header_streams, path_nodes, path_len, id);
+            samples[0][i] = ztimer_now(ZTIMER_USEC) - start;
+        }
+        report("encapsulate_routing_and_mac", samples[0], path_len, 0, iterations);
+    }
+
+    for (uint16_t i=0; i<iterations; i++) {
+        start = ztimer_now(ZTIMER_USEC);
+        hash_blinding_factor(stream_keys[0], message, shared_secrets[0]);
+        samples[0][i] = ztimer_now(ZTIMER_USEC) - start;
+    }
+    report("hash_blinding_factor", samples[0], 0, 0, iterations);
+}
+
+/* forwarding per message when a wakeup takes one datagram or a whole batch, the keyring check runs once per wakeup */
+static int8_t bench_batch(uint16_t iterations)
+{
+    static unsigned char batch[SPHINX_RECV_BATCH][SPHINX_MESSAGE_SIZE];
+    static const uint8_t sizes[] = { 1, SPHINX_RECV_BATCH };
+    const sphinx_class *cls = SPHINX_LARGEST_CLASS;
+    unsigned char id[ID_SIZE];
+    char data[PAYLOAD_SIZE] = "bench";
+    sphinx_ctx *ctx;
+    uint32_t start;
+    char name[32];
+
+    /* all messages of a batch are forwarded by the node after the sending one */
+    if ((ctx = sphinx_ctx_alloc()) == NULL) {
+        return -1;
+    }
+    sphinx_keyring_init(&bench_keyring, sphinx_pki_node(1), bench_keys[1]);
+
+    for (uint8_t s=0; s<ARRAY_SIZE(sizes); s++) {
+        for (uint16_t i=0; i<iterations; i++) {
+            /* messages are built outside the timing on a fixed path starting at the forwarding node */
+            for (uint8_t b=0; b<sizes[s]; b++) {
+                random_bytes(id, ID_SIZE);
+                ctx->cls = cls;
+                ctx->path_len_dest = cls->max_path;
+                ctx->path_len_reply = cls->max_path;
+                for (uint8_t j=0; j<2*cls->max_path; j++) {
+                    ctx->path_nodes[j] = sphinx_pki_node((1 + j) % BENCH_NODES);
+                }
+                ctx->step = SPHINX_STEP_SECRETS;
+                while (ctx->step < SPHINX_STEP_PAYLOAD) {
+                    sphinx_create_step(ctx, id, &local_addr, NULL, 0);
+                }
+                sphinx_seal_payload(ctx, ctx->shared_secrets, ctx->path_len_dest, data, cls->payload_size);
+                memcpy(batch[b], ctx->message, cls->message_size);
+            }
+
+            start = ztimer_now(ZTIMER_USEC);
+            sphinx_keyring_update(&bench_keyring);
+            for (uint8_t b=0; b<sizes[s]; b++) {
+                if (sphinx_process_message(batch[b], cls, &bench_keyring) < 0) {
+                    sphinx_ctx_free(ctx);
+                    return -1;
+                }
+            }
+            samples[0][i] = (ztimer_now(ZTIMER_USEC) - start) / sizes[s];
+        }
+        snprintf(name, sizeof(name), "recv_batch_%u", sizes[s]);
+        report(name, samples[0], cls->max_path, 0, iterations);
+    }
+
+    sphinx_ctx_free(ctx);
+    return 1;
+}
+
+/* lookups of fresh tags in a full replay filter against a scan of the full linear tag table it replaced */
+static void bench_replay(uint16_t iterations)
+{
+    static unsigned char linear_tags[128][TAG_SIZE];
+    replay_filter *filter = &bench_keyring.keys[0].replay;
+    unsigned char tags[BENCH_REPEAT][TAG_SIZE];
+    volatile uint8_t found = 0;
+    uint32_t start;
+    char name[32];
+
+    replay_filter_init(filter);
+    random_bytes((unsigned char *) linear_tags, sizeof(linear_tags));
+
+    /* probes are timed in a full filter, further tags are looked up but no longer stored */
+    for (uint32_t i=0; i<(uint32_t) SPHINX_REPLAY_CAPACITY * SPHINX_REPLAY_SHARDS; i++) {
+        random_bytes(tags[0], TAG_SIZE);
+        replay_filter_check(filter, tags[0]);
+    }
+
+    for (uint16_t i=0; i<iterations; i++) {
+        random_bytes((unsigned char *) tags, sizeof(tags));
+        start = ztimer_now(ZTIMER_USEC);
+        for (uint8_t j=0; j<BENCH_REPEAT; j++) {
+            replay_filter_check(filter, tags[j]);
+        }
+        samples[0][i] = ztimer_now(ZTIMER_USEC) - start;
+    }
+    snprintf(name, sizeof(name), "replay_filter_check_x%u", BENCH_REPEAT);
+    report(name, samples[0], 0, 0, iterations);
+
+    for (uint16_t i=0; i<iterations; i++) {
+        random_bytes((unsigned char *) tags, sizeof(tags));
+        start = ztimer_now(ZTIMER_USEC);
+        for (uint8_t j=0; j<BENCH_REPEAT; j++) {
+            for (uint8_t k=0; k<ARRAY_SIZE(linear_tags); k++) {
+                if (memcmp(linear_tags[k], tags[j], TAG_SIZE) == 0) {
+                    found++;
+                    break;
+                }
+            }
+        }
+        samples[0][i] = ztimer_now(ZTIMER_USEC) - start;
+    }
+    snprintf(name, sizeof(name), "replay_linear_scan_x%u", BENCH_REPEAT);
+    report(name, samples[0], 0, 0, iterations);
+}
+
+/* keystream xor at the lengths of its call sites: routing information of the header, surb and payload */
+static void bench_xor(uint16_t iterations)
+{
+    unsigned char stream_key[KEY_SIZE] = {0};
+    uint16_t lengths[2];
+    uint32_t start;
+    char name[32];
+
+    for (uint8_t c=0; c<SPHINX_CLASS_COUNT; c++) {
+        lengths[0] = sphinx_classes[c].enc_routing_size;
+        lengths[1] = sphinx_classes[c].prg_stream_size;
+
+        for (uint8_t l=0; l<ARRAY_SIZE(lengths); l++) {
+            for (uint16_t i=0; i<iterations; i++) {
+                start = ztimer_now(ZTIMER_USEC);
+                for (uint8_t j=0; j<BENCH_REPEAT; j++) {
+                    xor_stream_keyed(captured_message, lengths[l], 0, nonce, stream_key);
+                }
+                samples[0][i] = ztimer_now(ZTIMER_USEC) - start;
+            }
+            snprintf(name, sizeof(name), "xor_stream_keyed_%u_x%u", lengths[l], BENCH_REPEAT);
+            report(name, samples[0], 0, 0, iterations);
+
+            for (uint16_t i=0; i<iterations; i++) {
+                start = ztimer_now(ZTIMER_USEC);
+                for (uint8_t j=0; j<BENCH_REPEAT; j++) {
+                    xor_inplace(captured_message, &captured_message[SPHINX_MESSAGE_SIZE - lengths[l]], lengths[l]);
+                }
+                samples[0][i] = ztimer_now(ZTIMER_USEC) - start;
+            }
+            snprintf(name, sizeof(name), "xor_inplace_%u_x%u", lengths[l], BENCH_REPEAT);
+            report(name, samples[0], 0, 0, iterations);
+        }
+    }
+}
+
+/* path builds on directories grown with placeholder nodes, removed again afterwards */
+static void bench_paths(ipv6_addr_t *dest_addr, uint16_t iterations)
+{
+    static const uint32_t sizes[] = { 6, 100, 1000, 10000 };
+    network_node *path_nodes[SPHINX_MAX_PATH];
+    unsigned char public_key[KEY_SIZE] = {0};
+    ipv6_addr_t addr = {{0x20, 0x01, 0x0d, 0xb8}};
+    uint32_t count = sphinx_pki_count();
+    uint32_t start;
+    char name[32];
+
+    for (uint8_t s=0; s<ARRAY_SIZE(sizes); s++) {
+        if (sizes[s] < count) {
+            continue;
+        }
+
+        while (sphinx_pki_count() < sizes[s]) {
+            for (uint8_t i=0; i<sizeof(uint32_t); i++) {
+                addr.u8[ADDR_SIZE - 1 - i] = sphinx_pki_count() >> (8 * i);
+            }
+            if (sphinx_pki_add(&addr, public_key, NULL) < 0) {
+                break;
+            }
+        }
+        if (sphinx_pki_count() < sizes[s]) {
+            break;
+        }
+
+        for (uint16_t i=0; i<iterations; i++) {
+            start = ztimer_now(ZTIMER_USEC);
+            bulid_mix_path(path_nodes, SPHINX_MAX_PATH, &local_addr, dest_addr);
+            samples[0][i] = ztimer_now(ZTIMER_USEC) - start;
+        }
+        snprintf(name, sizeof(name), "build_mix_path_%lu", (unsigned long) sizes[s]);
+        report(name, samples[0], SPHINX_MAX_PATH, 0, iterations);
+    }
+
+    sphinx_pki_truncate(count);
+}
+
+int8_t sphinx_bench(uint16_t iterations)
+{
+    sphinx_transport_t transport = sphinx_transport;
+    uint8_t mix_threshold = sphinx_mix_threshold;
+    ipv6_addr_t addr = local_addr;
+    ipv6_addr_t *dest_addr;
+    int8_t res;
+
+    if (iterations == 0 || iterations > SPHINX_BENCH_ITERATIONS) {
+        iterations = SPHINX_BENCH_ITERATIONS;
+    }
+
+    /* the benchmark runs on generated nodes, the directory of this node is put back afterwards */
+    if (sphinx_pki_stash() < 0) {
+        return -1;
+    }
+    for (uint8_t i=0; i<BENCH_NODES; i++) {
+        if (sphinx_pki_add_generated(bench_keys[i]) < 0) {
+            sphinx_pki_unstash();
+            return -1;
+        }
+    }
+
+    /* messages are created from the first generated node to the second */
+    local_addr = sphinx_pki_node(0)->addr;
+    dest_addr = &sphinx_pki_node(1)->addr;
+
+    /* messages of the benchmark never leave this node and are forwarded without the mix pool */
+    sphinx_transport = capture_send;
+    sphinx_mix_threshold = 0;
+
+    puts("bench,name,path_len_dest,path_len_reply,n,mean_us,p50_us,p99_us,ops_per_sec");
+    bench_helpers(iterations);
+    bench_xor(iterations);
+    bench_replay(iterations);
+    bench_paths(dest_addr, iterations);
+    res = bench_create(dest_addr, iterations);
+    if (res > 0) {
+        res = bench_steps(dest_addr, iterations);
+    }
+    if (res > 0) {
+        res = bench_process(dest_addr, iterations);
+    }
+    if (res > 0) {
+        res = bench_batch(iterations);
+    }
+
+    sphinx_transport = transport;
+    sphinx_mix_threshold = mix_threshold;
+    local_addr = addr;
+    sphinx_pki_unstash();
+    memset(bench_keys, 0, sizeof(bench_keys));
+
+    if (res < 0) {
+        puts("error: benchmark message could not be created or processed");
+    }
+
+    return res;
+}
+
+#endif /* SPHINX_BENCH */
@@ -0,0 +1,34 @@
+#include "shpinx.h"
+
+/* ordered by size, messages of one class all have the same length */
+const sphinx_class sphinx_classes[SPHINX_CLASS_COUNT] =
+{
+    #if SPHINX_SMALL_CLASS
+    SPHINX_CLASS(SPHINX_SMALL_MAX_PATH, SPHINX_SMALL_PAYLOAD_SIZE),
+    #endif /* SPHINX_SMALL_CLASS */
+    SPHINX_CLASS(SPHINX_MAX_PATH, PAYLOAD_SIZE)
+};
+
+/* smallest class the payload fits in */
+const sphinx_class *sphinx_class_for_payload(size_t payload_size)
+{
+    for (uint8_t i=0; i<SPHINX_CLASS_COUNT; i++) {
+        if (payload_size <= sphinx_classes[i].payload_size) {
+            return &sphinx_classes[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* class of a received message, identified by its length */
+const sphinx_class *sphinx_class_for_message(size_t message_size)
+{
+    for (uint8_t i=0; i<SPHINX_CLASS_COUNT; i++) {
+        if (message_size == sphinx_classes[i].message_size) {
+            return &sphinx_classes[i];
+        }
+    }
+
+    return NULL;
+}
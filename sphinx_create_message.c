@@ -2,28 +2,14 @@
 
 int8_t bulid_mix_path(network_node *path_nodes[], uint8_t path_len, ipv6_addr_t *start_addr, ipv6_addr_t *dest_addr)
 {
-    uint32_t random;
-    char chosen[SPHINX_NET_SIZE] = {0};
-
-    /* select random mix nodes */
-    uint8_t i = 0;
-    while (i < (path_len-1)) {
-        random = random_uint32_range(0, SPHINX_NET_SIZE);
-
-        if (chosen[random]) {
-            continue;
-        }
-
-        if (ipv6_addr_equal(&network_pki[random].addr, start_addr) || ipv6_addr_equal(&network_pki[random].addr, dest_addr)) {
-            chosen[random] = '1';
-            continue;
-        }
-
-        path_nodes[i] = (network_node *) &network_pki[random];
-        chosen[random] = '1';
-        i++;
+    /* select random mix nodes, weighted by capacity and never the sender or destination */
+    if (sphinx_pki_sample(path_nodes, path_len - 1, start_addr, dest_addr) < 0) {
+        puts("error: not enough nodes in pki for path");
+        return -1;
     }
 
+    uint8_t i = path_len - 1;
+
     /* add final destination node */
     if ((path_nodes[i] = get_node(dest_addr)) == NULL) {
         puts("error: destination address not found in pki");
@@ -33,13 +19,13 @@ int8_t bulid_mix_path(network_node *path_nodes[], uint8_t path_len, ipv6_addr_t
     return 1;
 }
 
-void calculate_shared_secrets(unsigned char *sphinx_message, unsigned char shared_secrets[][KEY_SIZE], network_node *path_nodes[], uint8_t path_len)
+void calculate_shared_secrets(unsigned char *sphinx_message, unsigned char shared_secrets[][KEY_SIZE], unsigned char *node_keys[], uint8_t path_len, const unsigned char *sender_secret, uint8_t linear)
 {
     /* secret ecc key of the sender (x in sphinx spec) */
     unsigned char secret_key[KEY_SIZE];
 
-    /* public keys for computing the shared secrets at each hop (a0, a1, ... in sphinx spec) */
-    unsigned char public_keys[2*SPHINX_MAX_PATH][KEY_SIZE];
+    /* public keys of the previous and current hop (a0, a1, ... in sphinx spec), only a0 goes into the message */
+    unsigned char public_keys[2][KEY_SIZE];
 
     /* blinding factors for each hop (b0, b1, ... in sphinx spec) */
     unsigned char blinding_factors[2*SPHINX_MAX_PATH][KEY_SIZE];
@@ -47,8 +33,22 @@ void calculate_shared_secrets(unsigned char *sphinx_message, unsigned char share
     /* used to store intermediate results */
     unsigned char buff_shared_secret[KEY_SIZE];
 
-    /* generates an ephermal asymmetric key pair for the sender; public key for first hop is the generic public key of the sender */
-    crypto_box_keypair(public_keys[0], secret_key);
+    /* product of the sender secret and all blinding factors so far, reduced modulo the group order */
+    unsigned char blinded_secret[KEY_SIZE];
+
+    /* blinded secret in a form sphinx_scalarmult does not change by clamping */
+    unsigned char encoded_secret[KEY_SIZE];
+
+    /* clamped blinding factor */
+    unsigned char clamped_factor[KEY_SIZE];
+
+    /* generates an ephermal asymmetric key pair for the sender unless a known answer test gives the secret; public key for first hop is the generic public key of the sender */
+    if (sender_secret == NULL) {
+        sphinx_keypair(public_keys[0], secret_key);
+    } else {
+        memcpy(secret_key, sender_secret, KEY_SIZE);
+        sphinx_scalarmult_base(public_keys[0], secret_key);
+    }
 
     /* put public key for first hop in message */
     memcpy(sphinx_message, public_keys[0], KEY_SIZE);
@@ -56,7 +56,7 @@ void calculate_shared_secrets(unsigned char *sphinx_message, unsigned char share
     /* prepare root for calculation of public keys, shared secrets and blinding factors */
 
     /* calculates raw shared secret with first hop (s0 in sphinx spec) */
-    crypto_scalarmult(buff_shared_secret, secret_key, path_nodes[0]->public_key);
+    sphinx_scalarmult(buff_shared_secret, secret_key, node_keys[0]);
 
     /* hash shared secret */
     hash_shared_secret(shared_secrets[0], buff_shared_secret);
@@ -64,60 +64,85 @@ void calculate_shared_secrets(unsigned char *sphinx_message, unsigned char share
     /* calculates blinding factor at firt hop (b0 in sphinx spec) */
     hash_blinding_factor(blinding_factors[0], public_keys[0], shared_secrets[0]);
 
+    if (linear) {
+        clamp_scalar(blinded_secret, secret_key);
+    }
+
     /* iteratively calculates all remaining public keys, shared secrets and blinding factors */
     for (uint8_t i=1; i<path_len; i++) {
 
         /* blinds the public key for node i-1 to get public key for node i */
-        crypto_scalarmult(public_keys[i], blinding_factors[i-1], public_keys[i-1]);
+        sphinx_scalarmult(public_keys[i % 2], blinding_factors[i-1], public_keys[(i - 1) % 2]);
 
-        /* calculates the generic shared secret with node i */
-        crypto_scalarmult(buff_shared_secret, secret_key, path_nodes[i]->public_key);
+        if (linear) {
+            /* apply blinding factor i-1 to the running sender secret */
+            clamp_scalar(clamped_factor, blinding_factors[i-1]);
+            multiply_scalars(blinded_secret, blinded_secret, clamped_factor);
+        }
 
-        /* iteratively applies all past blinding to shared secret with node i */ // das hier für den SURB irgendwie auch machen :))))))))))))))))))
-        for (uint8_t j=0; j<i; j++) {
-            crypto_scalarmult(shared_secrets[i], blinding_factors[j], buff_shared_secret);
-            memcpy(buff_shared_secret, &shared_secrets[i], KEY_SIZE);
+        /* calculates the blinded shared secret with node i in one step */
+        if (linear && encode_scalar(encoded_secret, blinded_secret) > 0) {
+            sphinx_scalarmult(buff_shared_secret, encoded_secret, node_keys[i]);
+        } else {
+            /* calculates the generic shared secret with node i */
+            sphinx_scalarmult(buff_shared_secret, secret_key, node_keys[i]);
+
+            /* iteratively applies all past blinding to shared secret with node i */
+            for (uint8_t j=0; j<i; j++) {
+                sphinx_scalarmult(shared_secrets[i], blinding_factors[j], buff_shared_secret);
+                memcpy(buff_shared_secret, &shared_secrets[i], KEY_SIZE);
+            }
         }
 
         /* hash shared secret */
         hash_shared_secret(shared_secrets[i], buff_shared_secret);
 
         /* calculates blinding factor */
-        hash_blinding_factor(blinding_factors[i], public_keys[i], shared_secrets[i]);
+        hash_blinding_factor(blinding_factors[i], public_keys[i % 2], shared_secrets[i]);
+
+        #if DEBUG
+        printf("DEBUG: public key of hop %d\n", i);
+        print_hex_memory(public_keys[i % 2], KEY_SIZE);
+        #endif /* DEBUG */
     }
 
-    #if DEBUG
-    puts("DEBUG: public keys");
-    print_hex_memory(public_keys, path_len*KEY_SIZE);
-    #endif /* DEBUG */
+}
 
+void generate_header_streams(const sphinx_class *cls, unsigned char header_streams[][HEADER_STREAM_SIZE], unsigned char stream_keys[][KEY_SIZE], uint8_t path_len)
+{
+    /* padding and routing of a hop both lie in the first header_stream_size bytes of its stream */
+    for (uint8_t i=0; i<path_len; i++) {
+        memset(header_streams[i], 0, cls->header_stream_size);
+        xor_stream_keyed(header_streams[i], cls->header_stream_size, 0, nonce, stream_keys[i]);
+    }
 }
 
-void calculate_nodes_padding(unsigned char *nodes_padding, unsigned char shared_secrets[][KEY_SIZE], uint8_t path_len)
+void calculate_nodes_padding(const sphinx_class *cls, unsigned char *nodes_padding, unsigned char header_streams[][HEADER_STREAM_SIZE], uint8_t path_len)
 {
+    /* padding of a path of max length */
+    uint16_t max_nodes_padding = cls->enc_routing_size;
+
     uint8_t padding_size = 0;
 
     for (uint8_t i=0; i<path_len; i++) {
         /* move padding for NODE_ROUTE_SIZE = NODE_PADDING_SIZE bytes to the left */
-        memmove(&nodes_padding[MAX_NODES_PADDING - padding_size - NODE_ROUT_SIZE], &nodes_padding[MAX_NODES_PADDING - padding_size], padding_size);
+        memmove(&nodes_padding[max_nodes_padding - padding_size - NODE_ROUT_SIZE], &nodes_padding[max_nodes_padding - padding_size], padding_size);
         /* set the rightmost NODE_ROUTE_SIZE bytes to zero (this is the padding) */
-        memset(&nodes_padding[MAX_NODES_PADDING - NODE_ROUT_SIZE], 0, NODE_ROUT_SIZE);
+        memset(&nodes_padding[max_nodes_padding - NODE_ROUT_SIZE], 0, NODE_ROUT_SIZE);
         /* increase padding variable */
         padding_size += NODE_ROUT_SIZE;
-        /* calculate pseudo random byte stream with shared secret */
-        crypto_stream(prg_stream, MAX_NODES_PADDING + NODE_PADDING_SIZE, nonce, shared_secrets[i]);
-        /* xor padding with random byte stream */
-        xor_backwards_inplace(nodes_padding, MAX_NODES_PADDING, prg_stream, MAX_NODES_PADDING + NODE_PADDING_SIZE, padding_size);
+        /* xor padding with the end of the header stream of node i */
+        xor_inplace(&nodes_padding[max_nodes_padding - padding_size], &header_streams[i][cls->header_stream_size - padding_size], padding_size);
     }
 
     /* cutt off last node padding to move nodes padding in place for encapsulation of routing and mac */
-    memmove(&nodes_padding[MAX_NODES_PADDING - ((path_len - 1) * NODE_ROUT_SIZE)], &nodes_padding[MAX_NODES_PADDING - ((path_len) * NODE_ROUT_SIZE)], (path_len - 1) * NODE_ROUT_SIZE);
+    memmove(&nodes_padding[max_nodes_padding - ((path_len - 1) * NODE_ROUT_SIZE)], &nodes_padding[max_nodes_padding - ((path_len) * NODE_ROUT_SIZE)], (path_len - 1) * NODE_ROUT_SIZE);
 }
 
-void encapsulate_routing_and_mac(unsigned char *routing_and_mac, unsigned char shared_secrets[][KEY_SIZE], network_node *path_nodes[], uint8_t path_len, unsigned char *id)
+void encapsulate_routing_and_mac(const sphinx_class *cls, unsigned char *routing_and_mac, unsigned char shared_secrets[][KEY_SIZE], unsigned char header_streams[][HEADER_STREAM_SIZE], network_node *path_nodes[], uint8_t path_len, unsigned char *id)
 {
     /* padding to keep header size invariant regardless of actual path length */
-    uint8_t header_padding_size = (SPHINX_MAX_PATH - path_len) * NODE_ROUT_SIZE;
+    uint8_t header_padding_size = (cls->max_path - path_len) * NODE_ROUT_SIZE;
 
     /* prepare root routing information for iteration */
     memcpy(&routing_and_mac[MAC_SIZE], &path_nodes[path_len-1]->addr, ADDR_SIZE);
@@ -128,30 +153,27 @@ void encapsulate_routing_and_mac(unsigned char *routing_and_mac, unsigned char s
 
         #if DEBUG
         printf("DEBUG: decrypted Routing Inforation at Node %d\n", i);
-        print_hex_memory(&routing_and_mac[MAC_SIZE], ENC_ROUTING_SIZE);
+        print_hex_memory(&routing_and_mac[MAC_SIZE], cls->enc_routing_size);
         #endif /* DEBUG */
 
-        /* calculate pseudo random byte stream with shared secret */
-        crypto_stream(prg_stream, ENC_ROUTING_SIZE, nonce, shared_secrets[i]);
-
-        /* xor routing information for node i with prg stream */
-        xor_backwards_inplace(&routing_and_mac[MAC_SIZE], ENC_ROUTING_SIZE, prg_stream, ENC_ROUTING_SIZE, ENC_ROUTING_SIZE);
+        /* xor routing information for node i with the header stream of node i */
+        xor_inplace(&routing_and_mac[MAC_SIZE], header_streams[i], cls->enc_routing_size);
 
         /* calculate mac of encrypted routng information */
-        crypto_onetimeauth(routing_and_mac, &routing_and_mac[MAC_SIZE], ENC_ROUTING_SIZE, shared_secrets[i]);
+        sphinx_onetimeauth(routing_and_mac, &routing_and_mac[MAC_SIZE], cls->enc_routing_size, shared_secrets[i]);
 
         #if DEBUG
         printf("DEBUG: MAC of enrypted routing at Node %d\n", i);
         print_hex_memory(routing_and_mac, MAC_SIZE);
         printf("DEBUG: encrypted Routing Inforamtion at Node %d\n", i);
-        print_hex_memory(&routing_and_mac[MAC_SIZE], ENC_ROUTING_SIZE);
+        print_hex_memory(&routing_and_mac[MAC_SIZE], cls->enc_routing_size);
         #endif /* DEBUG */
 
         /* end early if last iteration */
         if (i>0) {
 
             /* cutt off node padding in routing_and_mac to make space for next hop address and mac */
-            memmove(&routing_and_mac[ADDR_SIZE + MAC_SIZE], routing_and_mac, MAC_SIZE + ENC_ROUTING_SIZE - NODE_PADDING_SIZE);
+            memmove(&routing_and_mac[ADDR_SIZE + MAC_SIZE], routing_and_mac, MAC_SIZE + cls->enc_routing_size - NODE_PADDING_SIZE);
 
             /* put address of node i in place for next iteration */
             memcpy(&routing_and_mac[MAC_SIZE], &path_nodes[i]->addr, ADDR_SIZE);
@@ -159,17 +181,16 @@ void encapsulate_routing_and_mac(unsigned char *routing_and_mac, unsigned char s
     }
 }
 
-void encrypt_surb_and_payload(unsigned char *surb_and_payload, unsigned char shared_secrets[][KEY_SIZE], uint8_t path_len)
+void encrypt_surb_and_payload(const sphinx_class *cls, unsigned char *surb_and_payload, unsigned char stream_keys[][KEY_SIZE], uint8_t path_len)
 {
     for (int8_t i=path_len-1; i>=0; i--) {
 
-        crypto_stream(prg_stream, PRG_STREAM_SIZE, nonce, shared_secrets[i]);
-
-        xor_backwards_inplace(surb_and_payload, MAC_SIZE + SURB_SIZE + PAYLOAD_SIZE, prg_stream, PRG_STREAM_SIZE, MAC_SIZE + SURB_SIZE + PAYLOAD_SIZE);
+        /* surb and payload are covered by the end of the stream node i decrypts the message with */
+        xor_stream_keyed(surb_and_payload, MAC_SIZE + cls->surb_size + cls->payload_size, cls->header_stream_size, nonce, stream_keys[i]);
     }
 }
 
-void build_sphinx_surb(unsigned char *sphinx_surb, unsigned char shared_secrets[][KEY_SIZE], unsigned char *id, network_node *path_nodes[], uint8_t path_len_reply)
+void build_sphinx_surb(sphinx_ctx *ctx, unsigned char *sphinx_surb, unsigned char shared_secrets[][KEY_SIZE], unsigned char stream_keys[][KEY_SIZE], unsigned char *id, network_node *path_nodes[], uint8_t path_len_reply)
 {
     #if DEBUG
     puts("DEBUG: SURB CREATION\n");
@@ -178,14 +199,16 @@ void build_sphinx_surb(unsigned char *sphinx_surb, unsigned char shared_secrets[
     /* save address of first hop to surb */
     memcpy(sphinx_surb, &path_nodes[0]->addr, ADDR_SIZE);
 
+    generate_header_streams(ctx->cls, ctx->header_streams, stream_keys, path_len_reply);
+
     /* precalculates the accumulated padding added at each hop */
-    calculate_nodes_padding(&sphinx_surb[ADDR_SIZE + MAC_SIZE], shared_secrets, path_len_reply);
+    calculate_nodes_padding(ctx->cls, &sphinx_surb[ADDR_SIZE + MAC_SIZE], ctx->header_streams, path_len_reply);
 
     /* calculates the nested encrypted routing information */
-    encapsulate_routing_and_mac(&sphinx_surb[ADDR_SIZE], shared_secrets, path_nodes, path_len_reply, id);
+    encapsulate_routing_and_mac(ctx->cls, &sphinx_surb[ADDR_SIZE], shared_secrets, ctx->header_streams, path_nodes, path_len_reply, id);
 }
 
-void build_sphinx_header(unsigned char *sphinx_header, unsigned char shared_secrets[][KEY_SIZE], network_node *path_nodes[], uint8_t path_len_dest)
+void build_sphinx_header(sphinx_ctx *ctx, unsigned char *sphinx_header, unsigned char shared_secrets[][KEY_SIZE], unsigned char stream_keys[][KEY_SIZE], network_node *path_nodes[], uint8_t path_len_dest)
 {
     #if DEBUG
     puts("DEBUG: HEADER CREATION\n");
@@ -195,70 +218,257 @@ void build_sphinx_header(unsigned char *sphinx_header, unsigned char shared_secr
     unsigned char id_dest[ID_SIZE];
     memset(&id_dest, 0x00, ID_SIZE);
 
+    generate_header_streams(ctx->cls, ctx->header_streams, stream_keys, path_len_dest);
+
     /* precalculates the accumulated padding added at each hop */
-    calculate_nodes_padding(&sphinx_header[KEY_SIZE + MAC_SIZE], shared_secrets, path_len_dest);
+    calculate_nodes_padding(ctx->cls, &sphinx_header[KEY_SIZE + MAC_SIZE], ctx->header_streams, path_len_dest);
     /* calculates the nested encrypted routing information */
-    encapsulate_routing_and_mac(&sphinx_header[KEY_SIZE], shared_secrets, path_nodes, path_len_dest, &id_dest[0]);
+    encapsulate_routing_and_mac(ctx->cls, &sphinx_header[KEY_SIZE], shared_secrets, ctx->header_streams, path_nodes, path_len_dest, &id_dest[0]);
 }
 
 
-int8_t sphinx_create_message(unsigned char *sphinx_message, unsigned char *id, ipv6_addr_t *dest_addr, char *data, size_t data_len)
+uint8_t sphinx_random_path_len(const sphinx_class *cls)
+{
+    return random_uint32_range(3, cls->max_path+1);
+}
+
+int8_t sphinx_create_begin(sphinx_ctx *ctx, size_t data_len)
 {
-    /* network path for sphinx message to destination and reply */
-    network_node* path_nodes[2*SPHINX_MAX_PATH];
+    /* smallest message class the data fits in */
+    if ((ctx->cls = sphinx_class_for_payload(data_len)) == NULL) {
+        return -1;
+    }
 
-    /* shared secrets with nodes in path */
-    unsigned char shared_secrets[2*SPHINX_MAX_PATH][KEY_SIZE];
+    /* choose random path lengths within the class */
+    ctx->path_len_dest = sphinx_random_path_len(ctx->cls);
+    ctx->path_len_reply = sphinx_random_path_len(ctx->cls);
+    ctx->step = SPHINX_STEP_PATH;
 
-    // was ist mit der integrity of the surb?
+    return 1;
+}
 
-    /* choose random number for path length to dest */
-    uint8_t path_len_dest = random_uint32_range(3, SPHINX_MAX_PATH+1);
+int8_t sphinx_create_step(sphinx_ctx *ctx, unsigned char *id, ipv6_addr_t *dest_addr, char *data, size_t data_len)
+{
+    uint8_t path_len_dest = ctx->path_len_dest;
+    uint8_t path_len_reply = ctx->path_len_reply;
 
-    /* choose random number for path length of reply */
-    uint8_t path_len_reply = random_uint32_range(3, SPHINX_MAX_PATH+1);
+    /* epoch public keys of the nodes in path */
+    unsigned char *node_keys[2*SPHINX_MAX_PATH];
 
-    #if DEBUG
-    printf("DEBUG: path_len_dest=%d\n\n", path_len_dest);
-    printf("DEBUG: path_len_reply=%d\n\n", path_len_reply);
-    #endif /* DEBUG */
+    uint32_t epoch;
+
+    switch (ctx->step) {
+    case SPHINX_STEP_PATH:
+        #if DEBUG
+        printf("DEBUG: path_len_dest=%d\n\n", path_len_dest);
+        printf("DEBUG: path_len_reply=%d\n\n", path_len_reply);
+        #endif /* DEBUG */
+
+        /* builds a random path to the destination and back */
+        if ((bulid_mix_path(ctx->path_nodes, path_len_dest, &local_addr, dest_addr) < 0) ||
+            (bulid_mix_path(&ctx->path_nodes[path_len_dest], path_len_reply, dest_addr, &local_addr)) < 0) {
+            puts("error: could not build mix path");
+            return -1;
+        }
+        break;
+
+    case SPHINX_STEP_SECRETS:
+        epoch = sphinx_current_epoch();
+
+        /* use the public keys of the nodes for the current epoch */
+        for (uint8_t i=0; i<path_len_dest+path_len_reply; i++) {
+            if ((node_keys[i] = get_epoch_public_key(ctx->path_nodes[i], epoch)) == NULL) {
+                puts("error: no epoch key for node in path");
+                return -1;
+            }
+        }
 
-    /* builds a random path to the destination and back */
-    if ((bulid_mix_path(path_nodes, path_len_dest, &local_addr, dest_addr) < 0) ||
-        (bulid_mix_path(&path_nodes[path_len_dest], path_len_reply, dest_addr, &local_addr)) < 0) {
-        puts("error: could not build mix path");
+        /* precomputes the shared secrets with all nodes in path */
+        calculate_shared_secrets(ctx->message, ctx->shared_secrets, node_keys, path_len_dest+path_len_reply, NULL, SPHINX_LINEAR_SECRETS);
+
+        #if DEBUG
+        puts("DEBUG: shared secrets");
+        print_hex_memory(ctx->shared_secrets, KEY_SIZE*(path_len_dest+path_len_reply));
+        #endif /* DEBUG */
+
+        /* each hop's stream key is derived once for header, surb and payload */
+        for (uint8_t i=0; i<path_len_dest+path_len_reply; i++) {
+            derive_stream_key(ctx->stream_keys[i], nonce, ctx->shared_secrets[i]);
+        }
+        break;
+
+    case SPHINX_STEP_HEADER:
+        build_sphinx_header(ctx, ctx->message, ctx->shared_secrets, ctx->stream_keys, ctx->path_nodes, path_len_dest);
+        break;
+
+    case SPHINX_STEP_SURB:
+        build_sphinx_surb(ctx, &ctx->message[ctx->cls->header_size + MAC_SIZE], &ctx->shared_secrets[path_len_dest], &ctx->stream_keys[path_len_dest], id, &ctx->path_nodes[path_len_dest], path_len_reply);
+
+        /* message is sent to first hop */
+        memcpy(&ctx->dest_addr, &ctx->path_nodes[0]->addr, ADDR_SIZE);
+        break;
+
+    case SPHINX_STEP_PAYLOAD:
+        /* adds payload and encrypts it for the path to the destination */
+        sphinx_seal_payload(ctx, ctx->shared_secrets, path_len_dest, data, data_len);
+        return 1;
+
+    default:
         return -1;
     }
 
-    /* precomputes the shared secrets with all nodes in path */
-    calculate_shared_secrets(sphinx_message, shared_secrets, path_nodes, path_len_dest+path_len_reply);
+    ctx->step++;
+    return 0;
+}
 
-    #if DEBUG
-    puts("DEBUG: shared secrets");
-    print_hex_memory(shared_secrets, KEY_SIZE*(path_len_dest+path_len_reply));
-    #endif /* DEBUG */
+int8_t sphinx_create_header(sphinx_ctx *ctx, unsigned char shared_secrets[][KEY_SIZE], uint8_t path_len_dest, uint8_t path_len_reply, unsigned char *id, ipv6_addr_t *dest_addr)
+{
+    ctx->path_len_dest = path_len_dest;
+    ctx->path_len_reply = path_len_reply;
+    ctx->step = SPHINX_STEP_PATH;
+
+    /* runs the steps up to the payload, sets first hop as destination of the context */
+    while (ctx->step < SPHINX_STEP_PAYLOAD) {
+        if (sphinx_create_step(ctx, id, dest_addr, NULL, 0) < 0) {
+            return -1;
+        }
+    }
 
-    /* put payload in place */
-    memcpy(&sphinx_message[HEADER_SIZE + MAC_SIZE + SURB_SIZE], data, data_len);
-    memset(&sphinx_message[HEADER_SIZE + MAC_SIZE + SURB_SIZE + data_len], 0, PAYLOAD_SIZE - data_len);
+    memcpy(shared_secrets, ctx->shared_secrets, KEY_SIZE*(path_len_dest+path_len_reply));
+
+    return 1;
+}
 
-    build_sphinx_header(sphinx_message, shared_secrets, path_nodes, path_len_dest);
+/* expects the stream keys of the path to the destination in the context */
+void sphinx_seal_payload(sphinx_ctx *ctx, unsigned char shared_secrets[][KEY_SIZE], uint8_t path_len_dest, char *data, size_t data_len)
+{
+    unsigned char *sphinx_message = ctx->message;
+    const sphinx_class *cls = ctx->cls;
 
-    build_sphinx_surb(&sphinx_message[HEADER_SIZE + MAC_SIZE], &shared_secrets[path_len_dest], id, &path_nodes[path_len_dest], path_len_reply);
+    /* put payload in place */
+    memcpy(&sphinx_message[cls->header_size + MAC_SIZE + cls->surb_size], data, data_len);
+    memset(&sphinx_message[cls->header_size + MAC_SIZE + cls->surb_size + data_len], 0, cls->payload_size - data_len);
 
     /* calculate mac of surb and payload for integrity checking at dest */
-    crypto_onetimeauth(&sphinx_message[HEADER_SIZE], &sphinx_message[HEADER_SIZE + MAC_SIZE], SURB_SIZE + PAYLOAD_SIZE, shared_secrets[path_len_dest-1]);
-    
+    sphinx_onetimeauth(&sphinx_message[cls->header_size], &sphinx_message[cls->header_size + MAC_SIZE], cls->surb_size + cls->payload_size, shared_secrets[path_len_dest-1]);
+
     /* encrypt surb payload and mac of both multiple times */
-    encrypt_surb_and_payload(&sphinx_message[HEADER_SIZE], shared_secrets, path_len_dest);
+    encrypt_surb_and_payload(cls, &sphinx_message[cls->header_size], ctx->stream_keys, path_len_dest);
 
     #if DEBUG
     puts("DEBUG: sphinx message");
-    print_hex_memory(sphinx_message, SPHINX_MESSAGE_SIZE);
+    print_hex_memory(sphinx_message, cls->message_size);
     #endif /* DEBUG */
+}
 
-    /* change destination to first hop */
-    memcpy(dest_addr, &path_nodes[0]->addr, ADDR_SIZE);
+int8_t sphinx_create_message(sphinx_ctx *ctx, unsigned char *id, ipv6_addr_t *dest_addr, char *data, size_t data_len)
+{
+    int8_t res;
 
-    return 1;
-}
\ No newline at end of file
+    if (sphinx_create_begin(ctx, data_len) < 0) {
+        return -1;
+    }
+
+    // was ist mit der integrity of the surb?
+
+    /* runs all steps at once, the sphinx thread runs them one event at a time */
+    while ((res = sphinx_create_step(ctx, id, dest_addr, data, data_len)) == 0) {}
+
+    return res;
+}
+/* known answer of a whole message, sender secret and path keys are fixed and both paths have the maximum length, so no random padding is added */
+static const unsigned char kat_sender_secret[KEY_SIZE] = {
+    0x4c, 0x9a, 0x3e, 0x71, 0x05, 0xd2, 0x8b, 0x66, 0xf1, 0x2d, 0x94, 0x5b, 0xc8, 0x37, 0xa0, 0x1e,
+    0x63, 0xbf, 0x08, 0xd5, 0x7a, 0x29, 0xe4, 0x90, 0x1c, 0x56, 0xab, 0x83, 0x3f, 0xe7, 0x62, 0x48
+};
+static const unsigned char kat_message[SPHINX_MESSAGE_SIZE] = {
+    0xfa, 0x9f, 0x08, 0x01, 0xdd, 0x55, 0x29, 0xb0, 0x95, 0x4b, 0x5e, 0x90, 0xf2, 0xb4, 0x1d, 0xea,
+    0xa0, 0x2b, 0x0e, 0x08, 0xb1, 0xb5, 0xb5, 0x67, 0xbd, 0xbf, 0x26, 0xe2, 0x51, 0x54, 0x9c, 0x7c,
+    0x9b, 0x8b, 0x1d, 0xf9, 0x48, 0x2a, 0x7e, 0xbd, 0xd3, 0x75, 0x2e, 0x94, 0x61, 0x60, 0xb4, 0x75,
+    0xaf, 0xc7, 0xca, 0x14, 0xcc, 0x6c, 0x24, 0x0f, 0xda, 0x21, 0xd6, 0x6f, 0x40, 0x4e, 0xe8, 0xe7,
+    0xfb, 0x22, 0xc3, 0x47, 0x4b, 0xf2, 0xec, 0x44, 0x3a, 0xe3, 0x57, 0x82, 0x97, 0x7e, 0x09, 0x53,
+    0x11, 0xbe, 0x0c, 0xf2, 0xc3, 0x82, 0x59, 0x89, 0x63, 0x6c, 0xa6, 0xf0, 0x75, 0xba, 0x57, 0x89,
+    0x53, 0x58, 0x6c, 0xd2, 0x40, 0x33, 0xaa, 0x11, 0xda, 0x94, 0xd1, 0x90, 0x1a, 0xcd, 0x03, 0xe1,
+    0x3e, 0xf0, 0x49, 0x51, 0x26, 0x73, 0x63, 0xa8, 0x6e, 0x6a, 0x9f, 0xd4, 0x9d, 0x8f, 0xad, 0x7c,
+    0xc3, 0x22, 0x17, 0x5c, 0x10, 0xcf, 0x7b, 0xa3, 0x5f, 0x8b, 0x18, 0xac, 0xae, 0x5f, 0x05, 0xea,
+    0x96, 0x83, 0xfc, 0x85, 0x61, 0x9a, 0x41, 0x67, 0xc9, 0x68, 0x8b, 0xe4, 0x93, 0x8c, 0x11, 0xee,
+    0x44, 0xb2, 0x86, 0x14, 0x20, 0xce, 0x3c, 0xbb, 0x9d, 0x72, 0x16, 0x72, 0x64, 0x19, 0x88, 0x79,
+    0xec, 0xab, 0x67, 0x92, 0xc1, 0x9d, 0x4b, 0x3b, 0x4f, 0x45, 0x9f, 0x1b, 0xb6, 0x54, 0xc3, 0xc8,
+    0x5f, 0x93, 0x1b, 0x71, 0x50, 0x79, 0xd0, 0xd5, 0xe3, 0x7c, 0x8a, 0x9a, 0xc9, 0xf9, 0x10, 0xe6,
+    0x4f, 0x6e, 0xcf, 0x9e, 0xa9, 0x88, 0x36, 0x8f, 0xd2, 0x72, 0xdb, 0x1f, 0xe4, 0x2e, 0xe3, 0xb3,
+    0x00, 0xa8, 0xe0, 0x17, 0x16, 0x60, 0x52, 0xc6, 0xdf, 0xfe, 0x4e, 0x14, 0xa0, 0x06, 0x49, 0x21,
+    0x87, 0x10, 0x6c, 0x98, 0xdc, 0xca, 0xb3, 0x32, 0xa9, 0x0f, 0xdf, 0x32, 0xbd, 0x9e, 0xfc, 0x6a,
+    0x85, 0x87, 0xc8, 0x41, 0xcf, 0x0e, 0x78, 0xb4, 0xa9, 0x9a, 0x66, 0xb0, 0xac, 0x57, 0xcb, 0x5d,
+    0xcb, 0x67, 0x04, 0xc8, 0x7c, 0xde, 0xce, 0x18, 0x06, 0x77, 0xc8, 0x57, 0xcc, 0x25, 0x26, 0x36,
+    0x75, 0x52, 0x14, 0xd0, 0xce, 0x54, 0xbc, 0x19, 0x4c, 0xfb, 0x83, 0xcd, 0x5a, 0x8e, 0xdb, 0xce,
+    0x13, 0x8c, 0x21, 0x01, 0x4c, 0x2a, 0xc7, 0xae, 0x8a, 0x1f, 0xdf, 0xc6, 0x9a, 0x5a, 0x63, 0x22,
+    0xac, 0x7e, 0xa1, 0x46, 0x01, 0x8c, 0x0a, 0xc9, 0xdd, 0x32, 0xef, 0x81, 0x72, 0x47, 0x86, 0x19,
+    0x0f, 0x8f, 0xe4, 0x94, 0x6d, 0xa2, 0x97, 0x7b, 0x1b, 0xfa, 0x8d, 0x88, 0x0f, 0x79, 0xc1, 0xda,
+    0x3b, 0x18, 0x2f, 0xb4, 0x11, 0xf6, 0x02, 0xd3, 0x12, 0xf7, 0xa4, 0xee, 0xe6, 0xfa, 0xd8, 0x29,
+    0x71, 0x3d, 0x24, 0x0d, 0x7a, 0x93, 0x4b, 0x2c, 0x21, 0xbe, 0x75, 0xa7, 0x60, 0x1a, 0x26, 0x51,
+    0x63, 0xc3, 0x56, 0xbe, 0x2e, 0xed, 0xc1, 0x1b, 0xc4, 0x91, 0x2d, 0x06, 0x90, 0xf1, 0xb3, 0x36,
+    0x62, 0xed, 0x1e, 0x87, 0x6c, 0x9a, 0xe3, 0xab, 0x98, 0x63, 0xfc, 0x64, 0x30, 0x7f, 0x1f, 0xe6,
+    0xbf, 0xc2, 0xce, 0x74, 0x2b, 0x7e, 0xa8, 0xbd, 0xf1, 0x75, 0x7a, 0x68, 0xe1, 0x85, 0x22, 0xc6,
+    0x00, 0xd0, 0x14, 0x2f, 0xd1, 0x1e, 0x72, 0x92, 0x57, 0x77, 0x8e, 0x2b, 0xe9, 0x42, 0x52, 0xd8,
+    0x29, 0x86, 0xdf, 0x69, 0x04, 0x0d, 0x17, 0x7d, 0x33, 0x87, 0x67, 0xdb, 0x35, 0xf1, 0x5d, 0x1d,
+    0x4a, 0xad, 0xa4, 0x4b, 0x85, 0xa7, 0xd1, 0x18, 0x2c, 0xdd, 0x52, 0x64, 0x62, 0x0b, 0xcb, 0x98,
+    0x8f, 0x48, 0x77, 0x93, 0x80, 0x04, 0xa6, 0x78, 0xf9, 0x8d, 0x6c, 0x4e, 0x56, 0x72, 0x9a, 0x15,
+    0xfa, 0xbd, 0x6f, 0x2f, 0xff, 0xe3, 0x7a, 0x15, 0xdb, 0xcc, 0x52, 0x69, 0x9e, 0x28, 0xf7, 0xb2,
+    0x31, 0xb1, 0x4a, 0xa8, 0x69, 0x74, 0x12, 0x84, 0xb7, 0xf1, 0xc9, 0x10, 0x92, 0x0b, 0xa4, 0x9b,
+    0x74, 0x20, 0x33, 0xff, 0xf0, 0xf7, 0x4c, 0x5c, 0x00, 0x40, 0xae, 0x2b, 0x07, 0x1b, 0xd7, 0x64
+};
+
+int8_t sphinx_create_selftest(void)
+{
+    /* mixes of the path to the destination and back, node i has address fe80::i+1 and the private key i+1, i+1, ... */
+    static network_node nodes[2*SPHINX_MAX_PATH];
+    unsigned char *node_keys[2*SPHINX_MAX_PATH];
+    unsigned char private_key[KEY_SIZE];
+    unsigned char id[ID_SIZE];
+    char data[] = "sphinx known answer";
+    sphinx_ctx *ctx;
+    int8_t res = 1;
+
+    if ((ctx = sphinx_ctx_alloc()) == NULL) {
+        puts("error: no free context for the message self-test");
+        return -1;
+    }
+
+    memset(nodes, 0, sizeof(nodes));
+    for (uint8_t i=0; i<2*SPHINX_MAX_PATH; i++) {
+        nodes[i].addr.u8[0] = 0xfe;
+        nodes[i].addr.u8[1] = 0x80;
+        nodes[i].addr.u8[ADDR_SIZE - 1] = i + 1;
+        memset(private_key, i + 1, KEY_SIZE);
+        sphinx_scalarmult_base(nodes[i].public_key, private_key);
+        ctx->path_nodes[i] = &nodes[i];
+        node_keys[i] = nodes[i].public_key;
+    }
+    for (uint8_t i=0; i<ID_SIZE; i++) {
+        id[i] = 0xa0 + i;
+    }
+
+    ctx->cls = SPHINX_LARGEST_CLASS;
+    ctx->path_len_dest = SPHINX_MAX_PATH;
+    ctx->path_len_reply = SPHINX_MAX_PATH;
+
+    /* both derivations of the shared secrets have to give the same message */
+    for (uint8_t linear=0; linear<2 && res>0; linear++) {
+        calculate_shared_secrets(ctx->message, ctx->shared_secrets, node_keys, 2*SPHINX_MAX_PATH, kat_sender_secret, linear);
+        for (uint8_t i=0; i<2*SPHINX_MAX_PATH; i++) {
+            derive_stream_key(ctx->stream_keys[i], nonce, ctx->shared_secrets[i]);
+        }
+
+        /* header, surb and payload are built like the ones of any other message */
+        ctx->step = SPHINX_STEP_HEADER;
+        while (sphinx_create_step(ctx, id, &nodes[SPHINX_MAX_PATH - 1].addr, data, sizeof(data)) == 0) {}
+
+        if (memcmp(ctx->message, kat_message, SPHINX_MESSAGE_SIZE) != 0) {
+            printf("error: message with %s shared secrets does not match known answer\n", linear ? "linear" : "nested");
+            res = -1;
+        }
+    }
+
+    sphinx_ctx_free(ctx);
+    return res;
+}
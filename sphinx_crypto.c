@@ -0,0 +1,247 @@
+#include "shpinx.h"
+
+#if SPHINX_CRYPTO_LIBSODIUM
+#include "sodium.h"
+#else
+#if SPHINX_CRYPTO_MONOCYPHER
+/* before tweetnacl.h, its macros rename crypto_sign and others */
+#include "monocypher.h"
+#endif /* SPHINX_CRYPTO_MONOCYPHER */
+#include "tweetnacl.h"
+#endif /* SPHINX_CRYPTO_LIBSODIUM */
+
+/* salsa20 constant */
+static const unsigned char sigma[16] = "expand 32-byte k";
+
+#if SPHINX_CRYPTO_LIBSODIUM
+
+/* libsodium of the host, only available on native and the host build */
+const char *sphinx_crypto_name = "libsodium";
+
+void sphinx_scalarmult(unsigned char *dest, const unsigned char *scalar, const unsigned char *point)
+{
+    /* fails only for low order points, the result is all zero then like with tweetnacl */
+    (void) crypto_scalarmult_curve25519(dest, scalar, point);
+}
+
+void sphinx_scalarmult_base(unsigned char *dest, const unsigned char *scalar)
+{
+    crypto_scalarmult_curve25519_base(dest, scalar);
+}
+
+void sphinx_hash(unsigned char *dest, const unsigned char *data, size_t data_len)
+{
+    crypto_hash_sha512(dest, data, data_len);
+}
+
+void sphinx_onetimeauth(unsigned char *mac, const unsigned char *data, size_t data_len, const unsigned char *key)
+{
+    crypto_onetimeauth_poly1305(mac, data, data_len, key);
+}
+
+int8_t sphinx_onetimeauth_verify(const unsigned char *mac, const unsigned char *data, size_t data_len, const unsigned char *key)
+{
+    return crypto_onetimeauth_poly1305_verify(mac, data, data_len, key) == 0 ? 1 : -1;
+}
+
+void sphinx_hsalsa20(unsigned char *dest, const unsigned char *input, const unsigned char *key)
+{
+    crypto_core_hsalsa20(dest, input, key, sigma);
+}
+
+void sphinx_salsa20_block(unsigned char *dest, const unsigned char *input, const unsigned char *key)
+{
+    crypto_core_salsa20(dest, input, key, sigma);
+}
+
+#else
+
+#if SPHINX_CRYPTO_MONOCYPHER
+
+/* x25519 of monocypher for mcus, it is several times faster than the one of tweetnacl */
+const char *sphinx_crypto_name = "monocypher";
+
+void sphinx_scalarmult(unsigned char *dest, const unsigned char *scalar, const unsigned char *point)
+{
+    crypto_x25519(dest, scalar, point);
+}
+
+void sphinx_scalarmult_base(unsigned char *dest, const unsigned char *scalar)
+{
+    crypto_x25519_public_key(dest, scalar);
+}
+
+#else
+
+const char *sphinx_crypto_name = "tweetnacl";
+
+void sphinx_scalarmult(unsigned char *dest, const unsigned char *scalar, const unsigned char *point)
+{
+    crypto_scalarmult(dest, scalar, point);
+}
+
+void sphinx_scalarmult_base(unsigned char *dest, const unsigned char *scalar)
+{
+    crypto_scalarmult_base(dest, scalar);
+}
+
+#endif /* SPHINX_CRYPTO_MONOCYPHER */
+
+/* hash, mac and stream stay with tweetnacl for both scalar multiplications */
+
+void sphinx_hash(unsigned char *dest, const unsigned char *data, size_t data_len)
+{
+    crypto_hash(dest, data, data_len);
+}
+
+void sphinx_onetimeauth(unsigned char *mac, const unsigned char *data, size_t data_len, const unsigned char *key)
+{
+    crypto_onetimeauth(mac, data, data_len, key);
+}
+
+int8_t sphinx_onetimeauth_verify(const unsigned char *mac, const unsigned char *data, size_t data_len, const unsigned char *key)
+{
+    return crypto_onetimeauth_verify(mac, data, data_len, key) == 0 ? 1 : -1;
+}
+
+void sphinx_hsalsa20(unsigned char *dest, const unsigned char *input, const unsigned char *key)
+{
+    crypto_core_hsalsa20(dest, input, key, sigma);
+}
+
+void sphinx_salsa20_block(unsigned char *dest, const unsigned char *input, const unsigned char *key)
+{
+    crypto_core_salsa20(dest, input, key, sigma);
+}
+
+#endif /* SPHINX_CRYPTO_LIBSODIUM */
+
+void sphinx_keypair(unsigned char *public_key, unsigned char *secret_key)
+{
+    random_bytes(secret_key, KEY_SIZE);
+    sphinx_scalarmult_base(public_key, secret_key);
+}
+
+/* known answers, every backend has to reproduce them to interoperate */
+static const unsigned char kat_scalar[KEY_SIZE] = {
+    0xa5, 0x46, 0xe3, 0x6b, 0xf0, 0x52, 0x7c, 0x9d, 0x3b, 0x16, 0x15, 0x4b, 0x82, 0x46, 0x5e, 0xdd,
+    0x62, 0x14, 0x4c, 0x0a, 0xc1, 0xfc, 0x5a, 0x18, 0x50, 0x6a, 0x22, 0x44, 0xba, 0x44, 0x9a, 0xc4
+};
+static const unsigned char kat_point[KEY_SIZE] = {
+    0xe6, 0xdb, 0x68, 0x67, 0x58, 0x30, 0x30, 0xdb, 0x35, 0x94, 0xc1, 0xa4, 0x24, 0xb1, 0x5f, 0x7c,
+    0x72, 0x66, 0x24, 0xec, 0x26, 0xb3, 0x35, 0x3b, 0x10, 0xa9, 0x03, 0xa6, 0xd0, 0xab, 0x1c, 0x4c
+};
+static const unsigned char kat_scalarmult[KEY_SIZE] = {
+    0xc3, 0xda, 0x55, 0x37, 0x9d, 0xe9, 0xc6, 0x90, 0x8e, 0x94, 0xea, 0x4d, 0xf2, 0x8d, 0x08, 0x4f,
+    0x32, 0xec, 0xcf, 0x03, 0x49, 0x1c, 0x71, 0xf7, 0x54, 0xb4, 0x07, 0x55, 0x77, 0xa2, 0x85, 0x52
+};
+/* alice's key pair of rfc 7748 */
+static const unsigned char kat_secret_key[KEY_SIZE] = {
+    0x77, 0x07, 0x6d, 0x0a, 0x73, 0x18, 0xa5, 0x7d, 0x3c, 0x16, 0xc1, 0x72, 0x51, 0xb2, 0x66, 0x45,
+    0xdf, 0x4c, 0x2f, 0x87, 0xeb, 0xc0, 0x99, 0x2a, 0xb1, 0x77, 0xfb, 0xa5, 0x1d, 0xb9, 0x2c, 0x2a
+};
+static const unsigned char kat_public_key[KEY_SIZE] = {
+    0x85, 0x20, 0xf0, 0x09, 0x89, 0x30, 0xa7, 0x54, 0x74, 0x8b, 0x7d, 0xdc, 0xb4, 0x3e, 0xf7, 0x5a,
+    0x0d, 0xbf, 0x3a, 0x0d, 0x26, 0x38, 0x1a, 0xf4, 0xeb, 0xa4, 0xa9, 0x8e, 0xaa, 0x9b, 0x4e, 0x6a
+};
+static const unsigned char kat_hash[HASH_SIZE] = {
+    0xdd, 0xaf, 0x35, 0xa1, 0x93, 0x61, 0x7a, 0xba, 0xcc, 0x41, 0x73, 0x49, 0xae, 0x20, 0x41, 0x31,
+    0x12, 0xe6, 0xfa, 0x4e, 0x89, 0xa9, 0x7e, 0xa2, 0x0a, 0x9e, 0xee, 0xe6, 0x4b, 0x55, 0xd3, 0x9a,
+    0x21, 0x92, 0x99, 0x2a, 0x27, 0x4f, 0xc1, 0xa8, 0x36, 0xba, 0x3c, 0x23, 0xa3, 0xfe, 0xeb, 0xbd,
+    0x45, 0x4d, 0x44, 0x23, 0x64, 0x3c, 0xe8, 0x0e, 0x2a, 0x9a, 0xc9, 0x4f, 0xa5, 0x4c, 0xa4, 0x9f
+};
+/* salsa20 key derived from the nonce with key 0, 1, ..., 31 */
+static const unsigned char kat_stream_key[KEY_SIZE] = {
+    0x72, 0xc7, 0xb1, 0x1e, 0xa8, 0x27, 0x55, 0x9c, 0x2b, 0x8a, 0x20, 0x5b, 0x86, 0xb4, 0x67, 0xfc,
+    0x30, 0xcd, 0x4d, 0xb0, 0x4e, 0xb6, 0xfa, 0x74, 0xb8, 0x23, 0x03, 0x12, 0x91, 0xc1, 0x01, 0x56
+};
+/* bytes 100 to 227 of the stream with key 0, 1, ..., 31, across three blocks */
+static const unsigned char kat_stream[2 * STREAM_BLOCK_SIZE] = {
+    0x07, 0x33, 0xb6, 0xf3, 0x33, 0xad, 0xf7, 0xb9, 0x62, 0xb4, 0xd4, 0xfc, 0x71, 0xe0, 0x8a, 0xb5,
+    0x2d, 0xb7, 0xa9, 0xc6, 0x08, 0x9f, 0x6a, 0x09, 0x6e, 0x8f, 0xbe, 0x4c, 0xe6, 0x0b, 0xb0, 0xae,
+    0x7e, 0x8a, 0x94, 0x98, 0x51, 0xb3, 0x90, 0x55, 0xba, 0x80, 0x81, 0x6d, 0x0b, 0xd2, 0x96, 0xd3,
+    0xae, 0xa9, 0x9c, 0xf1, 0xe9, 0xc4, 0xc3, 0xb3, 0x49, 0x0e, 0x3f, 0xf0, 0xd6, 0xae, 0x9f, 0xfb,
+    0x23, 0x3f, 0xab, 0xb7, 0xd8, 0xf3, 0x38, 0xbb, 0x1f, 0x9e, 0x51, 0x99, 0x20, 0xb9, 0x8a, 0x20,
+    0x27, 0x91, 0x53, 0x97, 0x89, 0xbb, 0x77, 0x83, 0x35, 0xb0, 0x68, 0x36, 0xd1, 0xb2, 0xe1, 0x3b,
+    0x44, 0x68, 0x2b, 0x66, 0x65, 0x0b, 0x6d, 0xf3, 0x7f, 0x3a, 0xf8, 0x40, 0xbd, 0xf8, 0x66, 0x38,
+    0x84, 0x54, 0x85, 0xe5, 0x5d, 0xd2, 0x11, 0x6c, 0x55, 0x27, 0x1d, 0x9c, 0x2e, 0x56, 0xbc, 0x5f
+};
+/* mac of "sphinx" with key 0, 1, ..., 31 */
+static const unsigned char kat_mac[MAC_SIZE] = {
+    0xdf, 0x43, 0x28, 0x9f, 0x17, 0xac, 0x2d, 0xcc, 0x6a, 0x09, 0xa8, 0x46, 0xe5, 0x83, 0x22, 0xc1
+};
+
+int8_t sphinx_crypto_selftest(void)
+{
+    unsigned char key[KEY_SIZE];
+    unsigned char result[2 * STREAM_BLOCK_SIZE];
+
+    /* running product of the sender secret and the blinding factors */
+    unsigned char product[KEY_SIZE];
+    unsigned char factor[KEY_SIZE];
+
+    for (uint8_t i=0; i<KEY_SIZE; i++) {
+        key[i] = i;
+    }
+
+    sphinx_scalarmult(result, kat_scalar, kat_point);
+    if (memcmp(result, kat_scalarmult, KEY_SIZE) != 0) {
+        puts("error: scalar multiplication does not match known answer");
+        return -1;
+    }
+
+    sphinx_scalarmult_base(result, kat_secret_key);
+    if (memcmp(result, kat_public_key, KEY_SIZE) != 0) {
+        puts("error: public key does not match known answer");
+        return -1;
+    }
+
+    /* a shared secret blinded with the product of all factors at once equals the one blinded hop by hop */
+    sphinx_scalarmult(result, kat_scalar, kat_point);
+    sphinx_scalarmult(&result[KEY_SIZE], kat_secret_key, result);
+    sphinx_scalarmult(result, kat_stream_key, &result[KEY_SIZE]);
+
+    clamp_scalar(product, (unsigned char *) kat_scalar);
+    clamp_scalar(factor, (unsigned char *) kat_secret_key);
+    multiply_scalars(product, product, factor);
+    clamp_scalar(factor, (unsigned char *) kat_stream_key);
+    multiply_scalars(product, product, factor);
+    if (encode_scalar(factor, product) < 0) {
+        puts("error: blinded scalar can not be encoded");
+        return -1;
+    }
+    sphinx_scalarmult(&result[KEY_SIZE], factor, kat_point);
+
+    if (memcmp(result, &result[KEY_SIZE], KEY_SIZE) != 0) {
+        puts("error: linear shared secret does not match the one blinded hop by hop");
+        return -1;
+    }
+
+    sphinx_hash(result, (const unsigned char *) "abc", 3);
+    if (memcmp(result, kat_hash, HASH_SIZE) != 0) {
+        puts("error: hash does not match known answer");
+        return -1;
+    }
+
+    derive_stream_key(result, nonce, key);
+    if (memcmp(result, kat_stream_key, KEY_SIZE) != 0) {
+        puts("error: stream key does not match known answer");
+        return -1;
+    }
+
+    memset(result, 0, sizeof(kat_stream));
+    xor_stream(result, sizeof(kat_stream), 100, nonce, key);
+    if (memcmp(result, kat_stream, sizeof(kat_stream)) != 0) {
+        puts("error: stream does not match known answer");
+        return -1;
+    }
+
+    sphinx_onetimeauth(result, (const unsigned char *) "sphinx", 6, key);
+    if (memcmp(result, kat_mac, MAC_SIZE) != 0 ||
+        sphinx_onetimeauth_verify(kat_mac, (const unsigned char *) "sphinx", 6, key) < 0) {
+        puts("error: mac does not match known answer");
+        return -1;
+    }
+
+    return 1;
+}
@@ -0,0 +1,42 @@
+#include "shpinx.h"
+
+/* message and keystream buffers, one context per message being created or processed */
+static sphinx_ctx ctx_pool[SPHINX_CTX_POOL_SIZE];
+
+/* mutex for the used flags of the contexts */
+static mutex_t ctx_mutex = MUTEX_INIT;
+
+sphinx_ctx *sphinx_ctx_alloc(void)
+{
+    sphinx_ctx *ctx = NULL;
+
+    mutex_lock(&ctx_mutex);
+
+    for (uint8_t i=0; i<SPHINX_CTX_POOL_SIZE; i++) {
+        if (!ctx_pool[i].used) {
+            ctx = &ctx_pool[i];
+            ctx->used = 1;
+            ctx->cls = SPHINX_LARGEST_CLASS;
+            break;
+        }
+    }
+
+    mutex_unlock(&ctx_mutex);
+
+    return ctx;
+}
+
+void sphinx_ctx_free(sphinx_ctx *ctx)
+{
+    /* shared secrets must not outlive the message */
+    memset(ctx->shared_secrets, 0, sizeof(ctx->shared_secrets));
+
+    mutex_lock(&ctx_mutex);
+    ctx->used = 0;
+    mutex_unlock(&ctx_mutex);
+}
+
+size_t sphinx_ctx_ram(void)
+{
+    return sizeof(ctx_pool);
+}
\ No newline at end of file
@@ -0,0 +1,188 @@
+#include "shpinx.h"
+
+#if defined(CPU_NATIVE) || defined(SPHINX_HOST)
+#include <time.h>
+#elif defined(MODULE_PERIPH_RTC)
+#include "periph/rtc.h"
+
+/* unix time of the start of 2020, the rtc counts from there */
+#define RIOT_EPOCH_UNIX 1577836800UL
+#endif
+
+/* shifts the local epoch count to match the rest of the network */
+static int32_t epoch_offset = 0;
+
+/* seconds of unix time, so nodes booted at different times agree on the epoch */
+static uint32_t epoch_clock(void)
+{
+#if defined(CPU_NATIVE) || defined(SPHINX_HOST)
+    return time(NULL);
+#elif defined(MODULE_PERIPH_RTC)
+    struct tm now;
+
+    rtc_get_time(&now);
+    return rtc_mktime(&now) + RIOT_EPOCH_UNIX;
+#else
+    /* boards without a clock count from boot and are aligned with the epoch command */
+    return ztimer_now(ZTIMER_SEC);
+#endif
+}
+
+uint32_t sphinx_current_epoch(void)
+{
+    return epoch_clock() / SPHINX_EPOCH_SEC + epoch_offset;
+}
+
+/* whether the clock of a sender within SPHINX_EPOCH_SKEW_SEC of this one may be in the epoch delta away */
+static uint8_t epoch_in_skew(int8_t delta)
+{
+#if defined(CPU_NATIVE) || defined(SPHINX_HOST) || defined(MODULE_PERIPH_RTC)
+    uint32_t phase = epoch_clock() % SPHINX_EPOCH_SEC;
+
+    if (delta < 0) {
+        return phase < SPHINX_EPOCH_SKEW_SEC;
+    }
+    if (delta > 0) {
+        return phase >= SPHINX_EPOCH_SEC - SPHINX_EPOCH_SKEW_SEC;
+    }
+    return 1;
+#else
+    /* the clock counts from boot and tells nothing about the boundaries of the network */
+    (void) delta;
+    return 1;
+#endif
+}
+
+void sphinx_set_epoch(uint32_t epoch)
+{
+    epoch_offset = 0;
+    epoch_offset = epoch - sphinx_current_epoch();
+}
+
+void hash_epoch_factor(unsigned char *dest, unsigned char *public_key, uint32_t epoch)
+{
+    unsigned char hash_input[KEY_SIZE + sizeof(uint32_t)];
+    unsigned char hash[HASH_SIZE];
+
+    memcpy(&hash_input[0], public_key, KEY_SIZE);
+    for (uint8_t i=0; i<sizeof(uint32_t); i++) {
+        hash_input[KEY_SIZE + i] = epoch >> (8 * i);
+    }
+    sphinx_hash(hash, hash_input, sizeof(hash_input));
+    memcpy(dest, &hash, KEY_SIZE);
+}
+
+unsigned char *get_epoch_public_key(network_node *node, uint32_t epoch)
+{
+    unsigned char epoch_factor[KEY_SIZE];
+
+    /* computed on first use in an epoch */
+    if (!node->epoch_valid || node->epoch != epoch) {
+        /* blind the long term public key with the epoch factor */
+        hash_epoch_factor(epoch_factor, node->public_key, epoch);
+        sphinx_scalarmult(node->epoch_public_key, epoch_factor, node->public_key);
+        node->epoch = epoch;
+        node->epoch_valid = 1;
+    }
+
+    return node->epoch_public_key;
+}
+
+static void epoch_key_derive(epoch_key *key, sphinx_keyring *keyring, uint32_t epoch)
+{
+    unsigned char private_key[KEY_SIZE];
+    unsigned char epoch_secret[KEY_SIZE];
+
+    /* replay store of the expired epoch is dropped at once */
+    replay_filter_init(&key->replay);
+
+    key->epoch = epoch;
+    key->valid = 1;
+    hash_epoch_factor(key->epoch_factor, keyring->node->public_key, epoch);
+
+    /* epoch private key is the product of the long term private key and the epoch factor */
+    clamp_scalar(private_key, keyring->private_key);
+    clamp_scalar(epoch_secret, key->epoch_factor);
+    multiply_scalars(epoch_secret, private_key, epoch_secret);
+    key->encoded = (encode_scalar(key->private_key, epoch_secret) > 0);
+}
+
+static epoch_key *find_epoch_key(sphinx_keyring *keyring, uint32_t epoch)
+{
+    for (uint8_t i=0; i<SPHINX_KEY_EPOCHS; i++) {
+        if (keyring->keys[i].valid && keyring->keys[i].epoch == epoch) {
+            return &keyring->keys[i];
+        }
+    }
+
+    return NULL;
+}
+
+void sphinx_keyring_init(sphinx_keyring *keyring, network_node *node, const unsigned char *private_key)
+{
+    memset(keyring, 0, sizeof(sphinx_keyring));
+    keyring->node = node;
+    memcpy(keyring->private_key, private_key, KEY_SIZE);
+    sphinx_keyring_update(keyring);
+}
+
+void sphinx_keyring_update(sphinx_keyring *keyring)
+{
+    uint32_t epoch = sphinx_current_epoch();
+    uint8_t rotated = keyring->keys[0].valid;
+
+    if (rotated && epoch == keyring->epoch) {
+        return;
+    }
+
+    keyring->epoch = epoch;
+
+    /* drop keys outside of previous, current and next epoch */
+    for (uint8_t i=0; i<SPHINX_KEY_EPOCHS; i++) {
+        if (keyring->keys[i].epoch - (epoch - 1) > 2) {
+            keyring->keys[i].valid = 0;
+        }
+    }
+
+    /* derive missing keys into the freed slots */
+    for (uint32_t e=epoch-1; e!=epoch+2; e++) {
+        if (find_epoch_key(keyring, e) != NULL) {
+            continue;
+        }
+        for (uint8_t i=0; i<SPHINX_KEY_EPOCHS; i++) {
+            if (!keyring->keys[i].valid) {
+                epoch_key_derive(&keyring->keys[i], keyring, e);
+                break;
+            }
+        }
+    }
+
+    if (rotated) {
+        puts("sphinx: rotated epoch keys");
+    }
+}
+
+epoch_key *epoch_shared_secret(unsigned char *dest, sphinx_keyring *keyring, unsigned char *public_key, uint8_t try)
+{
+    /* try current key first, then previous and next one */
+    static const int8_t epoch_order[SPHINX_KEY_EPOCHS] = { 0, -1, 1 };
+
+    unsigned char raw_shared_secret[KEY_SIZE];
+    epoch_key *key;
+
+    /* neighbouring keys are skipped away from their boundary, so garbage costs one scalar multiplication */
+    if (!epoch_in_skew(epoch_order[try]) || (key = find_epoch_key(keyring, keyring->epoch + epoch_order[try])) == NULL) {
+        return NULL;
+    }
+
+    if (key->encoded) {
+        sphinx_scalarmult(raw_shared_secret, key->private_key, public_key);
+    } else {
+        sphinx_scalarmult(raw_shared_secret, keyring->private_key, public_key);
+        sphinx_scalarmult(raw_shared_secret, key->epoch_factor, raw_shared_secret);
+    }
+
+    hash_shared_secret(dest, raw_shared_secret);
+
+    return key;
+}
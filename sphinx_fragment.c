@@ -0,0 +1,146 @@
+#include "shpinx.h"
+
+/* transfers being reassembled at the destination, fragments may arrive on several threads */
+static reassembly_slot reassembly[SPHINX_REASSEMBLY_SLOTS];
+static mutex_t reassembly_mutex = MUTEX_INIT;
+
+/* ring of the transfers completed last, transfer 0 is never used so empty entries never match */
+static completed_transfer completed[SPHINX_COMPLETED_TRANSFERS];
+static uint8_t completed_next = 0;
+
+size_t fragment_encode(unsigned char *dest, uint32_t transfer, uint8_t index, uint8_t count, const char *data, uint8_t data_len)
+{
+    for (uint8_t i=0; i<sizeof(uint32_t); i++) {
+        dest[i] = transfer >> (8 * i);
+    }
+    dest[FRAGMENT_INDEX] = index;
+    dest[FRAGMENT_COUNT] = count;
+    dest[FRAGMENT_LEN] = data_len;
+    memcpy(&dest[FRAGMENT_HEADER_SIZE], data, data_len);
+
+    return FRAGMENT_HEADER_SIZE + data_len;
+}
+
+size_t fragment_ram(void)
+{
+    return sizeof(reassembly) + sizeof(completed);
+}
+
+static void deliver(const unsigned char *data, size_t size)
+{
+    printf("sphinx: %.*s\n", (int) size, data);
+}
+
+static int8_t is_completed(uint32_t transfer, uint8_t count)
+{
+    for (uint8_t i=0; i<SPHINX_COMPLETED_TRANSFERS; i++) {
+        if (completed[i].transfer == transfer && completed[i].count == count) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static reassembly_slot *find_slot(uint32_t transfer, uint8_t count, uint32_t now)
+{
+    reassembly_slot *slot = NULL;
+
+    for (uint8_t i=0; i<SPHINX_REASSEMBLY_SLOTS; i++) {
+        if (reassembly[i].used && reassembly[i].transfer == transfer && reassembly[i].count == count) {
+            return &reassembly[i];
+        }
+    }
+
+    /* take a free slot or one whose transfer stalled */
+    for (uint8_t i=0; i<SPHINX_REASSEMBLY_SLOTS; i++) {
+        if (!reassembly[i].used || now - reassembly[i].timestamp > SPHINX_REASSEMBLY_TIMEOUT_MS) {
+            slot = &reassembly[i];
+            break;
+        }
+    }
+
+    if (slot == NULL) {
+        return NULL;
+    }
+
+    if (slot->used) {
+        puts("sphinx: incomplete transfer evicted");
+    }
+
+    slot->transfer = transfer;
+    slot->count = count;
+    slot->received = 0;
+    slot->size = 0;
+    slot->used = 1;
+
+    return slot;
+}
+
+int8_t fragment_receive(const unsigned char *payload, size_t payload_size)
+{
+    uint32_t transfer = 0;
+    uint8_t index = payload[FRAGMENT_INDEX];
+    uint8_t count = payload[FRAGMENT_COUNT];
+    uint8_t data_len = payload[FRAGMENT_LEN];
+    const unsigned char *data = &payload[FRAGMENT_HEADER_SIZE];
+    uint32_t now = ztimer_now(ZTIMER_MSEC);
+    reassembly_slot *slot;
+
+    for (uint8_t i=0; i<sizeof(uint32_t); i++) {
+        transfer |= (uint32_t) payload[i] << (8 * i);
+    }
+
+    /* all fragments but the last are full */
+    if (count == 0 || count > SPHINX_MAX_FRAGMENTS || index >= count || data_len > payload_size - FRAGMENT_HEADER_SIZE ||
+        (index < count - 1 && data_len != FRAGMENT_DATA_SIZE)) {
+        puts("error: malformed fragment");
+        return -1;
+    }
+
+    /* payload fits in one message */
+    if (count == 1) {
+        deliver(data, data_len);
+        return 1;
+    }
+
+    mutex_lock(&reassembly_mutex);
+
+    /* the acknowledgement of a fragment of a delivered transfer got lost, acknowledge it again */
+    if (is_completed(transfer, count)) {
+        mutex_unlock(&reassembly_mutex);
+        printf("sphinx: fragment %u of %u of a delivered transfer received again\n", index + 1, count);
+        return 1;
+    }
+
+    /* not acknowledged, the sender transmits the fragment again */
+    if ((slot = find_slot(transfer, count, now)) == NULL) {
+        mutex_unlock(&reassembly_mutex);
+        puts("error: no buffer to reassemble transfer");
+        return -1;
+    }
+
+    memcpy(&slot->data[index * FRAGMENT_DATA_SIZE], data, data_len);
+    slot->received |= (uint32_t) 1 << index;
+    slot->timestamp = now;
+
+    if (index == count - 1) {
+        slot->size = index * FRAGMENT_DATA_SIZE + data_len;
+    }
+
+    printf("sphinx: fragment %u of %u received\n", index + 1, count);
+
+    /* retransmitted fragments leave the mask unchanged */
+    if (slot->received == (UINT32_MAX >> (32 - count))) {
+        deliver(slot->data, slot->size);
+        slot->used = 0;
+
+        completed[completed_next].transfer = transfer;
+        completed[completed_next].count = count;
+        completed_next = (completed_next + 1) % SPHINX_COMPLETED_TRANSFERS;
+    }
+
+    mutex_unlock(&reassembly_mutex);
+
+    return 1;
+}
@@ -1,5 +1,11 @@
 #include "shpinx.h"
 
+/* order of the prime subgroup of curve25519 (l in rfc 7748), little endian */
+static const unsigned char group_order[KEY_SIZE] = { 0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58, 0xd6, 0x9c, 0xf7, 0xa2, 0xde, 0xf9, 0xde, 0x14, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10 };
+
+/* inverse of the cofactor 8 modulo the group order */
+static const unsigned char cofactor_inverse[KEY_SIZE] = { 0x79, 0x2f, 0xdc, 0xe2, 0x29, 0xe5, 0x06, 0x61, 0xd0, 0xda, 0x1c, 0x7d, 0xb3, 0x9d, 0xd3, 0x07, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x06 };
+
 void print_hex_memory(void *mem, uint16_t mem_size)
 {
     unsigned char *p = (unsigned char *) mem;
@@ -21,69 +27,172 @@ void print_id(unsigned char *id)
     printf(": ");
 }
 
-int8_t get_local_ipv6_addr(ipv6_addr_t *result)
+void hash_blinding_factor(unsigned char *dest, unsigned char *public_key, unsigned char *sharde_secret)
+{
+    unsigned char hash_input[2 * KEY_SIZE];
+    unsigned char hash[HASH_SIZE];
+
+    memcpy(&hash_input[0], public_key, KEY_SIZE);
+    memcpy(&hash_input[KEY_SIZE], sharde_secret, KEY_SIZE);
+    sphinx_hash(hash, hash_input, sizeof(hash_input));
+    memcpy(dest, &hash, KEY_SIZE);
+}
+
+void hash_shared_secret(unsigned char *dest, unsigned char *raw_sharde_secret)
 {
-    netif_t *netif;
-    ipv6_addr_t addrs[1];
+    unsigned char hash[HASH_SIZE];
+    sphinx_hash(hash, raw_sharde_secret, KEY_SIZE);
+    memcpy(dest, &hash, KEY_SIZE);
+}
 
-    netif = netif_iter(NULL);
+/* xors num_bytes of arg into dest, a word at a time where possible */
+void xor_inplace(unsigned char *dest, const unsigned char *arg, size_t num_bytes)
+{
+    uint32_t word, arg_word;
+    size_t i = 0;
 
-    if ((netif_get_ipv6(netif, addrs, ARRAY_SIZE(addrs))) < 0) {
-        return -1;
+    for (; i+sizeof(uint32_t)<=num_bytes; i+=sizeof(uint32_t)) {
+        memcpy(&word, &dest[i], sizeof(uint32_t));
+        memcpy(&arg_word, &arg[i], sizeof(uint32_t));
+        word ^= arg_word;
+        memcpy(&dest[i], &word, sizeof(uint32_t));
     }
-    *result = addrs[0];
-    return 1;
+
+    for (; i<num_bytes; i++) {
+        dest[i] ^= arg[i];
+    }
+}
+
+void derive_stream_key(unsigned char *stream_key, const unsigned char *nonce, const unsigned char *key)
+{
+    /* xsalsa20 derives a salsa20 key from the first 16 bytes of the nonce */
+    sphinx_hsalsa20(stream_key, nonce, key);
 }
 
-network_node *get_node(ipv6_addr_t *node_addr)
-{   
-    for (uint8_t i=0; i < SPHINX_NET_SIZE; i++) {
-        if (ipv6_addr_equal(&network_pki[i].addr, node_addr)) {
-            return (network_node*) &network_pki[i];
+void xor_stream_keyed(unsigned char *dest, size_t len, size_t offset, const unsigned char *nonce, const unsigned char *stream_key)
+{
+    unsigned char block_input[16];
+    unsigned char block[STREAM_BLOCK_SIZE];
+
+    uint64_t counter = offset / STREAM_BLOCK_SIZE;
+    uint8_t skip = offset % STREAM_BLOCK_SIZE;
+    uint8_t num_bytes;
+
+    memcpy(block_input, &nonce[16], 8);
+
+    /* only the blocks covering the requested range are generated */
+    while (len > 0) {
+        for (uint8_t i=0; i<8; i++) {
+            block_input[8 + i] = counter >> (8 * i);
+        }
+        sphinx_salsa20_block(block, block_input, stream_key);
+
+        num_bytes = STREAM_BLOCK_SIZE - skip;
+        if (num_bytes > len) {
+            num_bytes = len;
         }
+        xor_inplace(dest, &block[skip], num_bytes);
+
+        dest += num_bytes;
+        len -= num_bytes;
+        skip = 0;
+        counter++;
     }
 
-    /* nothing found */
-    return NULL;
+    memset(block, 0, STREAM_BLOCK_SIZE);
 }
 
-int8_t udp_send(ipv6_addr_t *dest_addr, unsigned char *message, size_t message_size)
+void xor_stream(unsigned char *dest, size_t len, size_t offset, const unsigned char *nonce, const unsigned char *key)
 {
-    /* set up remote endpoint */
-    sock_udp_ep_t remote = { .family = AF_INET6 };
-    remote.port = SPHINX_PORT;
-    memcpy(remote.addr.ipv6, dest_addr, sizeof(ipv6_addr_t));
-
-    /* send message */
-    if (sock_udp_send(NULL, message, message_size, &remote) < 0) {
-        puts("error: could not send message with udp");
-        return -1;
-    }
+    unsigned char stream_key[KEY_SIZE];
 
-    return 1;
+    derive_stream_key(stream_key, nonce, key);
+    xor_stream_keyed(dest, len, offset, nonce, stream_key);
+
+    memset(stream_key, 0, KEY_SIZE);
 }
 
-void hash_blinding_factor(unsigned char *dest, unsigned char *public_key, unsigned char *sharde_secret)
+/* reduces a 64 limb number modulo the group order (modL of tweetnacl) */
+static void reduce_scalar(unsigned char *dest, int64_t x[64])
 {
-    unsigned char hash_input[2 * KEY_SIZE];
-    unsigned char hash[crypto_hash_BYTES];
+    int64_t carry;
+    int16_t i, j;
 
-    memcpy(&hash_input[0], public_key, KEY_SIZE);
-    memcpy(&hash_input[KEY_SIZE], sharde_secret, KEY_SIZE);
-    crypto_hash(hash, hash_input, sizeof(hash_input));
-    memcpy(dest, &hash, KEY_SIZE);
+    for (i=63; i>=32; i--) {
+        carry = 0;
+        for (j=i-32; j<i-12; j++) {
+            x[j] += carry - 16 * x[i] * group_order[j - (i - 32)];
+            carry = (x[j] + 128) >> 8;
+            x[j] -= carry << 8;
+        }
+        x[j] += carry;
+        x[i] = 0;
+    }
+
+    carry = 0;
+    for (j=0; j<32; j++) {
+        x[j] += carry - (x[31] >> 4) * group_order[j];
+        carry = x[j] >> 8;
+        x[j] &= 255;
+    }
+
+    for (j=0; j<32; j++) {
+        x[j] -= carry * group_order[j];
+    }
+
+    for (i=0; i<32; i++) {
+        x[i+1] += x[i] >> 8;
+        dest[i] = x[i] & 255;
+    }
 }
 
-void hash_shared_secret(unsigned char *dest, unsigned char *raw_sharde_secret)
+void clamp_scalar(unsigned char *dest, unsigned char *scalar)
 {
-    unsigned char hash[crypto_hash_BYTES];
-    crypto_hash(hash, raw_sharde_secret, KEY_SIZE);
-    memcpy(dest, &hash, KEY_SIZE);
+    memcpy(dest, scalar, KEY_SIZE);
+    dest[0] &= 248;
+    dest[31] &= 127;
+    dest[31] |= 64;
 }
 
-void xor_backwards_inplace(unsigned char *dest, size_t dest_size, unsigned char *arg, size_t arg_size, uint16_t num_bytes)
+void multiply_scalars(unsigned char *dest, unsigned char *a, unsigned char *b)
 {
-    for (int i=1; i<=num_bytes; i++) {
-        dest[dest_size - i] = dest[dest_size -  i] ^ arg[arg_size - i];
+    int64_t x[64] = {0};
+
+    for (uint8_t i=0; i<KEY_SIZE; i++) {
+        for (uint8_t j=0; j<KEY_SIZE; j++) {
+            x[i+j] += (int64_t) a[i] * b[j];
+        }
     }
+
+    reduce_scalar(dest, x);
+}
+
+int8_t encode_scalar(unsigned char *dest, unsigned char *scalar)
+{
+    /* scalar multiplication clamps every scalar, so a reduced scalar s is passed as 8*w with w = +-s/8 mod l and 2^251 <= w < 2^252 */
+    unsigned char w[KEY_SIZE];
+    int16_t borrow = 0;
+
+    multiply_scalars(w, scalar, (unsigned char *) cofactor_inverse);
+
+    /* use -w instead, the x coordinate of -P equals the one of P */
+    if (w[31] < 0x08 || w[31] > 0x0f) {
+        for (uint8_t i=0; i<KEY_SIZE; i++) {
+            borrow = group_order[i] - w[i] - borrow;
+            w[i] = borrow & 255;
+            borrow = (borrow >> 8) & 1;
+        }
+        /* neither representation survives clamping (probability about 2^-126) */
+        if (w[31] < 0x08 || w[31] > 0x0f) {
+            return -1;
+        }
+    }
+
+    /* multiply with cofactor */
+    for (uint8_t i=KEY_SIZE-1; i>0; i--) {
+        dest[i] = (w[i] << 3) | (w[i-1] >> 5);
+    }
+    dest[0] = w[0] << 3;
+
+    return 1;
 }
\ No newline at end of file
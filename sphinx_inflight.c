@@ -0,0 +1,329 @@
+#include "shpinx.h"
+
+#define NO_SLOT UINT16_MAX
+
+/* slab of send descriptors, queued or waiting for an acknowledgement */
+static event_send slots[SPHINX_INFLIGHT_SIZE];
+static uint16_t free_slots[SPHINX_INFLIGHT_SIZE];
+static uint16_t free_count = 0;
+static uint8_t initialized = 0;
+
+/* hash index on the message id, chained through next_slot */
+static uint16_t buckets[SPHINX_INFLIGHT_BUCKETS];
+static uint16_t next_slot[SPHINX_INFLIGHT_SIZE];
+
+/* min heap of slots ordered by retransmit deadline, heap_pos maps a slot to its heap position */
+static uint16_t heap[SPHINX_INFLIGHT_SIZE];
+static uint16_t heap_pos[SPHINX_INFLIGHT_SIZE];
+static uint16_t heap_count = 0;
+
+static void init(void)
+{
+    for (uint16_t i=0; i<SPHINX_INFLIGHT_SIZE; i++) {
+        free_slots[i] = SPHINX_INFLIGHT_SIZE - 1 - i;
+    }
+    free_count = SPHINX_INFLIGHT_SIZE;
+
+    for (uint16_t i=0; i<SPHINX_INFLIGHT_BUCKETS; i++) {
+        buckets[i] = NO_SLOT;
+    }
+
+    initialized = 1;
+}
+
+static uint16_t id_bucket(unsigned char *id)
+{
+    /* ids are random, so their first bytes are a good hash */
+    return (id[0] | (id[1] << 8)) & (SPHINX_INFLIGHT_BUCKETS - 1);
+}
+
+static uint32_t deadline(uint16_t slot)
+{
+    return slots[slot].timestamp + MSG_TIMEOUT_MS;
+}
+
+/* compares deadlines, robust against timer overflow */
+static int8_t before(uint16_t a, uint16_t b)
+{
+    return (int32_t) (deadline(a) - deadline(b)) < 0;
+}
+
+static void heap_swap(uint16_t i, uint16_t j)
+{
+    uint16_t slot = heap[i];
+
+    heap[i] = heap[j];
+    heap[j] = slot;
+    heap_pos[heap[i]] = i;
+    heap_pos[heap[j]] = j;
+}
+
+static void heap_sift(uint16_t i)
+{
+    /* move up */
+    while (i > 0 && before(heap[i], heap[(i - 1) / 2])) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+
+    /* move down */
+    while (1) {
+        uint16_t smallest = i;
+        uint16_t left = 2 * i + 1;
+        uint16_t right = 2 * i + 2;
+
+        if (left < heap_count && before(heap[left], heap[smallest])) {
+            smallest = left;
+        }
+        if (right < heap_count && before(heap[right], heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            break;
+        }
+        heap_swap(i, smallest);
+        i = smallest;
+    }
+}
+
+static uint16_t find_slot(unsigned char *id)
+{
+    for (uint16_t slot=buckets[id_bucket(id)]; slot!=NO_SLOT; slot=next_slot[slot]) {
+        if (memcmp(slots[slot].id, id, ID_SIZE) == 0) {
+            return slot;
+        }
+    }
+
+    return NO_SLOT;
+}
+
+uint16_t inflight_count(void)
+{
+    return heap_count;
+}
+
+size_t inflight_ram(void)
+{
+    return sizeof(slots) + sizeof(free_slots) + sizeof(buckets) + sizeof(next_slot) + sizeof(heap) + sizeof(heap_pos);
+}
+
+event_send *inflight_alloc(void)
+{
+    event_send *msg = NULL;
+
+    /* descriptors are taken by any thread and released by the sphinx thread */
+    mutex_lock(&sent_msg_mutex);
+
+    if (!initialized) {
+        init();
+    }
+
+    if (free_count > 0) {
+        msg = &slots[free_slots[--free_count]];
+        msg->used = 1;
+        msg->transfer = 0;
+        msg->ctx = NULL;
+        msg->queued = 0;
+        msg->acked = 0;
+    }
+
+    mutex_unlock(&sent_msg_mutex);
+
+    return msg;
+}
+
+void inflight_free(event_send *msg)
+{
+    mutex_lock(&sent_msg_mutex);
+
+    msg->used = 0;
+    free_slots[free_count++] = msg - slots;
+
+    mutex_unlock(&sent_msg_mutex);
+}
+
+/* expects sent_msg_mutex to be locked */
+static int8_t transfer_pending(uint32_t transfer)
+{
+    for (uint16_t i=0; i<SPHINX_INFLIGHT_SIZE; i++) {
+        if (slots[i].used && slots[i].transfer == transfer) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+uint32_t inflight_new_transfer(void)
+{
+    uint32_t transfer;
+
+    mutex_lock(&sent_msg_mutex);
+
+    /* 0 marks descriptors without transfer */
+    do {
+        transfer = random_uint32();
+    } while (transfer == 0 || transfer_pending(transfer));
+
+    mutex_unlock(&sent_msg_mutex);
+
+    return transfer;
+}
+
+int8_t inflight_transfer_pending(uint32_t transfer)
+{
+    int8_t pending;
+
+    /* a transfer is pending while any of its fragments is queued or waiting for an acknowledgement */
+    mutex_lock(&sent_msg_mutex);
+    pending = transfer_pending(transfer);
+    mutex_unlock(&sent_msg_mutex);
+
+    return pending;
+}
+
+void inflight_insert(event_send *msg)
+{
+    uint16_t slot = msg - slots;
+    uint16_t bucket;
+
+    /* add to index */
+    bucket = id_bucket(msg->id);
+    next_slot[slot] = buckets[bucket];
+    buckets[bucket] = slot;
+
+    /* add to deadline order */
+    heap[heap_count] = slot;
+    heap_pos[slot] = heap_count;
+    heap_count++;
+    heap_sift(heap_count - 1);
+}
+
+event_send *inflight_find(unsigned char *id)
+{
+    uint16_t slot;
+
+    if (!initialized || (slot = find_slot(id)) == NO_SLOT) {
+        return NULL;
+    }
+
+    return &slots[slot];
+}
+
+int8_t inflight_remove(unsigned char *id)
+{
+    uint16_t slot;
+    uint16_t *link;
+    uint16_t pos;
+
+    if (!initialized || (slot = find_slot(id)) == NO_SLOT) {
+        return -1;
+    }
+
+    /* remove from index */
+    for (link=&buckets[id_bucket(id)]; *link!=slot; link=&next_slot[*link]) {}
+    *link = next_slot[slot];
+
+    /* remove from deadline order */
+    pos = heap_pos[slot];
+    heap_count--;
+    if (pos != heap_count) {
+        heap_swap(pos, heap_count);
+        heap_sift(pos);
+    }
+
+    /* a queued retransmit is released when the sphinx thread gets to it */
+    if (slots[slot].queued) {
+        slots[slot].acked = 1;
+    } else {
+        inflight_free(&slots[slot]);
+    }
+    return 1;
+}
+
+event_send *inflight_next_expired(uint32_t now)
+{
+    if (heap_count == 0 || (int32_t) (now - deadline(heap[0])) < 0) {
+        return NULL;
+    }
+
+    return &slots[heap[0]];
+}
+
+int8_t inflight_next_deadline(uint32_t *next_deadline)
+{
+    if (heap_count == 0) {
+        return -1;
+    }
+
+    *next_deadline = deadline(heap[0]);
+    return 1;
+}
+
+void inflight_reschedule(event_send *msg)
+{
+    heap_sift(heap_pos[msg - slots]);
+}
+
+/* inserts, expires and removes descriptors with deadlines before any real one, the sphinx thread must not run */
+int8_t inflight_selftest(void)
+{
+    static const uint8_t order[] = { 2, 0, 1 };
+    event_send *msgs[3];
+    uint16_t count = inflight_count();
+    uint32_t base = ztimer_now(ZTIMER_MSEC) - (UINT32_C(1) << 30);
+    int8_t res = 1;
+    uint8_t n;
+
+    for (n=0; n<ARRAY_SIZE(msgs); n++) {
+        if ((msgs[n] = inflight_alloc()) == NULL) {
+            break;
+        }
+        random_bytes(msgs[n]->id, ID_SIZE);
+        msgs[n]->timestamp = base + (n + 2) % ARRAY_SIZE(msgs);
+        inflight_insert(msgs[n]);
+    }
+
+    if (n < ARRAY_SIZE(msgs)) {
+        puts("error: no free slots for the check of sent messages");
+        res = -1;
+    }
+
+    /* found by id, nothing expires before the earliest deadline */
+    for (uint8_t i=0; i<n && res>0; i++) {
+        if (inflight_find(msgs[i]->id) != msgs[i]) {
+            puts("error: sent message not found by id");
+            res = -1;
+        }
+    }
+    if (res > 0 && inflight_next_expired(base + MSG_TIMEOUT_MS - 1) != NULL) {
+        puts("error: sent message expired before its deadline");
+        res = -1;
+    }
+
+    /* expire in deadline order, a rescheduled message moves back */
+    if (res > 0) {
+        msgs[1]->timestamp = base + ARRAY_SIZE(msgs);
+        inflight_reschedule(msgs[1]);
+    }
+    for (uint8_t i=0; i<ARRAY_SIZE(order) && res>0; i++) {
+        if (inflight_next_expired(base + MSG_TIMEOUT_MS + ARRAY_SIZE(msgs)) != msgs[order[i]] ||
+            inflight_remove(msgs[order[i]]->id) < 0 || inflight_find(msgs[order[i]]->id) != NULL) {
+            puts("error: sent messages do not expire in deadline order");
+            res = -1;
+        }
+    }
+
+    /* leave the table as it was */
+    for (uint8_t i=0; i<n; i++) {
+        if (msgs[i]->used) {
+            inflight_remove(msgs[i]->id);
+        }
+    }
+    if (res > 0 && inflight_count() != count) {
+        puts("error: sent messages left in the table");
+        res = -1;
+    }
+
+    return res;
+}
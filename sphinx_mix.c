@@ -0,0 +1,137 @@
+#include "shpinx.h"
+
+#if SPHINX_MIX_POOL_SIZE
+
+/* a processed message waiting in the pool for the next flush */
+typedef struct {
+    ipv6_addr_t next_hop;
+    size_t size;
+    uint32_t timestamp;
+    unsigned char message[SPHINX_MESSAGE_SIZE];
+} mix_entry;
+
+static mix_entry pool[SPHINX_MIX_POOL_SIZE];
+static uint8_t pool_count = 0;
+
+/* messages in the pool that trigger a flush, 0 forwards every message at once */
+uint8_t sphinx_mix_threshold = SPHINX_MIX_THRESHOLD;
+
+/* flushes the pool once its oldest message waited SPHINX_MIX_TIMEOUT_MS */
+static event_queue_t *flush_queue;
+static void handle_flush(event_t *event);
+static event_t flush_event = { .handler = handle_flush };
+static event_timeout_t flush_timeout;
+
+void sphinx_mix_init(event_queue_t *queue)
+{
+    flush_queue = queue;
+    event_timeout_ztimer_init(&flush_timeout, ZTIMER_MSEC, queue, &flush_event);
+}
+
+uint8_t sphinx_mix_count(void)
+{
+    return pool_count;
+}
+
+size_t sphinx_mix_ram(void)
+{
+    return sizeof(pool);
+}
+
+void sphinx_mix_flush(void)
+{
+    uint8_t order[SPHINX_MIX_POOL_SIZE];
+    uint8_t count = pool_count;
+    uint8_t j;
+
+    event_timeout_clear(&flush_timeout);
+    event_cancel(flush_queue, &flush_event);
+
+    if (count == 0) {
+        return;
+    }
+
+    /* send in random order so the output does not reveal the order of arrival */
+    for (uint8_t i=0; i<count; i++) {
+        j = random_uint32_range(0, i + 1);
+        order[i] = order[j];
+        order[j] = i;
+    }
+
+    for (uint8_t i=0; i<count; i++) {
+        mix_entry *entry = &pool[order[i]];
+
+        STATS_TIME(mix_delay, STATS_NOW() - entry->timestamp);
+
+        if (sphinx_transport(&entry->next_hop, entry->message, entry->size) < 0) {
+            puts("error: could not send message of mix pool");
+        }
+    }
+
+    pool_count = 0;
+
+    STATS_COUNT(mix_flushes);
+    STATS_COUNT_N(mix_flushed, count);
+}
+
+static void handle_flush(event_t *event)
+{
+    (void) event;
+    sphinx_mix_flush();
+}
+
+int8_t sphinx_mix_forward(ipv6_addr_t *next_hop, unsigned char *message, size_t message_size)
+{
+    mix_entry *entry;
+
+    /* pool is disabled */
+    if (sphinx_mix_threshold == 0) {
+        return sphinx_transport(next_hop, message, message_size);
+    }
+
+    entry = &pool[pool_count++];
+    entry->next_hop = *next_hop;
+    entry->size = message_size;
+    entry->timestamp = STATS_NOW();
+    memcpy(entry->message, message, message_size);
+
+    STATS_PEAK(mix_peak, pool_count);
+
+    if (pool_count >= sphinx_mix_threshold || pool_count == SPHINX_MIX_POOL_SIZE) {
+        sphinx_mix_flush();
+    } else if (pool_count == 1) {
+        event_timeout_set(&flush_timeout, SPHINX_MIX_TIMEOUT_MS);
+    }
+
+    return 1;
+}
+
+#else
+
+uint8_t sphinx_mix_threshold = 0;
+
+void sphinx_mix_init(event_queue_t *queue)
+{
+    (void) queue;
+}
+
+uint8_t sphinx_mix_count(void)
+{
+    return 0;
+}
+
+size_t sphinx_mix_ram(void)
+{
+    return 0;
+}
+
+void sphinx_mix_flush(void)
+{
+}
+
+int8_t sphinx_mix_forward(ipv6_addr_t *next_hop, unsigned char *message, size_t message_size)
+{
+    return sphinx_transport(next_hop, message, message_size);
+}
+
+#endif /* SPHINX_MIX_POOL_SIZE */
@@ -0,0 +1,33 @@
+#include "shpinx.h"
+
+/* riot network glue, the host build provides its own */
+
+int8_t get_local_ipv6_addr(ipv6_addr_t *result)
+{
+    netif_t *netif;
+    ipv6_addr_t addrs[1];
+
+    netif = netif_iter(NULL);
+
+    if ((netif_get_ipv6(netif, addrs, ARRAY_SIZE(addrs))) < 0) {
+        return -1;
+    }
+    *result = addrs[0];
+    return 1;
+}
+
+int8_t udp_send(ipv6_addr_t *dest_addr, unsigned char *message, size_t message_size)
+{
+    /* set up remote endpoint */
+    sock_udp_ep_t remote = { .family = AF_INET6 };
+    remote.port = SPHINX_PORT;
+    memcpy(remote.addr.ipv6, dest_addr, sizeof(ipv6_addr_t));
+
+    /* send message */
+    if (sock_udp_send(NULL, message, message_size, &remote) < 0) {
+        puts("error: could not send message with udp");
+        return -1;
+    }
+
+    return 1;
+}
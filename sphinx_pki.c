@@ -0,0 +1,594 @@
+#include "shpinx.h"
+
+/* nodes are stored in chunks that never move, so node pointers stay valid while the directory grows */
+#define PKI_CHUNK_SIZE 16
+#define NO_NODE UINT32_MAX
+
+/* longest pki file line: address, public and private key separated by spaces, with some slack for whitespace and \r\n */
+#define PKI_LINE_SIZE (IPV6_ADDR_MAX_STR_LEN + 4 * KEY_SIZE + 8)
+
+static network_node **chunks = NULL;
+static uint32_t chunk_count = 0;
+static uint32_t node_count = 0;
+
+/* fenwick tree over the node weights, entry i holds the weights of the nodes i - (i & -i) to i - 1 */
+static uint32_t *weight_tree = NULL;
+static uint32_t total_weight = 0;
+
+/* open addressed index on the node address, at most half full */
+static uint32_t *index_slots = NULL;
+static uint32_t index_size = 0;
+
+/* private key of this node, the directory holds only public keys of the others */
+static unsigned char self_private_key[KEY_SIZE];
+static uint8_t self_known = 0;
+
+#if SPHINX_PKI_DEFAULT
+/* nodes of the test network, each node gets its private key on its own */
+const pki_record sphinx_default_pki[SPHINX_DEFAULT_PKI_SIZE] =
+{
+    /* 0 */
+    {
+        /* ipv6 address */
+        {{0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x30, 0xc7, 0x6e, 0xff, 0xfe, 0x39, 0xa0, 0x5f}},
+        /* public key */
+        {0xb3, 0x92, 0x25, 0xc9, 0xd8, 0x41, 0x9d, 0x06, 0xb3, 0x7a, 0xe2, 0x64, 0x8b, 0xca, 0x9f, 0x83, 0x1b, 0xd1, 0xee, 0x08, 0x02, 0xd1, 0xcd, 0x8f, 0xbf, 0x36, 0x5e, 0x47, 0xba, 0xdb, 0x68, 0x09}
+    },
+    /* 1 */
+    {
+        /* ipv6 address */
+        {{0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xb0, 0x6d, 0xfe, 0xff, 0xfe, 0xfd, 0x0a, 0x0d}},
+        /* public key */
+        {0xd5, 0x88, 0x47, 0x3e, 0x97, 0xc0, 0x53, 0x30, 0xa9, 0x32, 0xf5, 0x74, 0xa0, 0xd9, 0x30, 0xec, 0x03, 0x1e, 0x34, 0x2e, 0xec, 0xc3, 0x9b, 0x67, 0xc1, 0x56, 0xe1, 0x1f, 0x73, 0xef, 0x2b, 0x3a}
+    },
+    /* 2 */
+    {
+        /* ipv6 address */
+        {{0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x28, 0x29, 0x2a, 0xff, 0xfe, 0x75, 0x73, 0x3f}},
+        /* public key */
+        {0x2b, 0xef, 0xff, 0x0b, 0x68, 0x1f, 0xd8, 0x14, 0x02, 0xb1, 0x20, 0x27, 0xaa, 0xda, 0x1b, 0x0a, 0x85, 0x63, 0x75, 0x8e, 0xab, 0x00, 0xe1, 0x80, 0xa9, 0x3c, 0xb9, 0x6b, 0x3b, 0xb1, 0xf3, 0x44}
+    },
+    /* 3 */
+    {
+        /* ipv6 address */
+        {{0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x20, 0x65, 0x35, 0xff, 0xfe, 0xc7, 0x45, 0x5b}},
+        /* public key */
+        {0x87, 0x68, 0x06, 0xf2, 0x59, 0x83, 0x5d, 0x43, 0x9f, 0x8a, 0xf5, 0xdc, 0xab, 0x41, 0x74, 0x85, 0x8f, 0x9e, 0x1c, 0xe2, 0x75, 0x60, 0x14, 0xb8, 0x6c, 0x52, 0xc6, 0x22, 0xb8, 0xee, 0xbb, 0x1e}
+    },
+    /* 4 */
+    {
+        /* ipv6 address */
+        {{0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xa0, 0xc6, 0xf3, 0xff, 0xfe, 0xf6, 0x2b, 0xb6}},
+        /* public key */
+        {0x3d, 0x55, 0x59, 0xfc, 0x81, 0x23, 0x01, 0xe3, 0x83, 0x2c, 0x97, 0x2c, 0x4b, 0x54, 0x22, 0x23, 0x88, 0x25, 0x71, 0x4e, 0x5b, 0xdc, 0xb5, 0x93, 0x40, 0x8b, 0xe4, 0xb5, 0xf0, 0xd1, 0xa6, 0x1a}
+    },
+    /* 5 */
+    {
+        /* ipv6 address */
+        {{0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x28, 0x9f, 0x66, 0xff, 0xfe, 0xa9, 0x1b, 0x31}},
+        /* public key */
+        {0xad, 0xb9, 0x1f, 0x56, 0x9a, 0xff, 0x33, 0x3a, 0xb6, 0x12, 0xb8, 0x91, 0x19, 0xc7, 0x80, 0xc2, 0x27, 0xe2, 0xe0, 0x6d, 0xef, 0xc3, 0x0a, 0x6b, 0xb3, 0x51, 0xa9, 0x77, 0x88, 0xa0, 0x50, 0x3e}
+    }
+};
+#endif /* SPHINX_PKI_DEFAULT */
+
+/* fnv-1a over the address */
+static uint32_t addr_hash(ipv6_addr_t *addr)
+{
+    uint32_t hash = 2166136261u;
+
+    for (uint8_t i=0; i<ADDR_SIZE; i++) {
+        hash = (hash ^ addr->u8[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+/* returns the index slot holding addr, or the empty slot it would go to */
+static uint32_t *index_lookup(ipv6_addr_t *addr)
+{
+    uint32_t slot = addr_hash(addr) & (index_size - 1);
+
+    while (index_slots[slot] != NO_NODE && !ipv6_addr_equal(&sphinx_pki_node(index_slots[slot])->addr, addr)) {
+        slot = (slot + 1) & (index_size - 1);
+    }
+
+    return &index_slots[slot];
+}
+
+static int8_t index_grow(void)
+{
+    uint32_t *old_slots = index_slots;
+    uint32_t new_size = index_size ? 2 * index_size : 2 * PKI_CHUNK_SIZE;
+
+    if ((index_slots = malloc(new_size * sizeof(uint32_t))) == NULL) {
+        index_slots = old_slots;
+        return -1;
+    }
+
+    memset(index_slots, 0xff, new_size * sizeof(uint32_t));
+    index_size = new_size;
+
+    /* reinsert all nodes */
+    for (uint32_t i=0; i<node_count; i++) {
+        *index_lookup(&sphinx_pki_node(i)->addr) = i;
+    }
+
+    free(old_slots);
+    return 1;
+}
+
+/* sum of the weights of the nodes before index */
+static uint32_t weight_prefix(uint32_t index)
+{
+    uint32_t sum = 0;
+
+    for (; index>0; index&=index-1) {
+        sum += weight_tree[index];
+    }
+
+    return sum;
+}
+
+static void weight_add(uint32_t index, int32_t delta)
+{
+    for (index++; index<=node_count; index+=index&-index) {
+        weight_tree[index] += delta;
+    }
+    total_weight += delta;
+}
+
+/* index of the node whose weight range contains point, point must be below the total weight */
+static uint32_t weight_find(uint32_t point)
+{
+    uint32_t index = 0;
+    uint32_t step = 1;
+
+    while (2 * step <= node_count) {
+        step *= 2;
+    }
+
+    for (; step>0; step/=2) {
+        if (index + step <= node_count && weight_tree[index + step] <= point) {
+            index += step;
+            point -= weight_tree[index];
+        }
+    }
+
+    return index;
+}
+
+static uint32_t index_of(ipv6_addr_t *addr)
+{
+    return node_count ? *index_lookup(addr) : NO_NODE;
+}
+
+uint32_t sphinx_pki_count(void)
+{
+    return node_count;
+}
+
+/* position of the node in the directory, UINT32_MAX if it is unknown */
+uint32_t sphinx_pki_index(ipv6_addr_t *addr)
+{
+    return index_of(addr);
+}
+
+network_node *sphinx_pki_node(uint32_t index)
+{
+    return &chunks[index / PKI_CHUNK_SIZE][index % PKI_CHUNK_SIZE];
+}
+
+network_node *get_node(ipv6_addr_t *node_addr)
+{
+    uint32_t node;
+
+    if ((node = index_of(node_addr)) == NO_NODE) {
+        return NULL;
+    }
+
+    return sphinx_pki_node(node);
+}
+
+const unsigned char *sphinx_pki_private_key(void)
+{
+    unsigned char public_key[KEY_SIZE];
+    ipv6_addr_t self_addr;
+    network_node *node;
+
+    #ifdef SPHINX_PRIVATE_KEY
+    /* key given at build time, used until another one is added with the pki */
+    if (!self_known && parse_hex_key(self_private_key, SPHINX_PRIVATE_KEY) > 0) {
+        self_known = 1;
+    }
+    #endif /* SPHINX_PRIVATE_KEY */
+
+    if (!self_known || get_local_ipv6_addr(&self_addr) < 0 || (node = get_node(&self_addr)) == NULL) {
+        return NULL;
+    }
+
+    /* a key that does not belong to the public key of this node in the pki is not used */
+    sphinx_scalarmult_base(public_key, self_private_key);
+    if (memcmp(public_key, node->public_key, KEY_SIZE) != 0) {
+        return NULL;
+    }
+
+    return self_private_key;
+}
+
+int8_t sphinx_pki_add(ipv6_addr_t *addr, const unsigned char *public_key, const unsigned char *private_key)
+{
+    network_node *node;
+    ipv6_addr_t self_addr;
+    uint32_t *slot;
+    uint32_t index;
+
+    if ((node = get_node(addr)) == NULL) {
+
+        /* keep the index at most half full */
+        if (2 * (node_count + 1) > index_size && index_grow() < 0) {
+            puts("error: out of memory for pki index");
+            return -1;
+        }
+
+        /* start a new chunk */
+        if (node_count == chunk_count * PKI_CHUNK_SIZE) {
+            network_node **new_chunks = realloc(chunks, (chunk_count + 1) * sizeof(network_node *));
+            uint32_t *new_tree = realloc(weight_tree, ((chunk_count + 1) * PKI_CHUNK_SIZE + 1) * sizeof(uint32_t));
+            if (new_chunks != NULL) {
+                chunks = new_chunks;
+            }
+            if (new_tree != NULL) {
+                weight_tree = new_tree;
+            }
+            if (new_chunks == NULL || new_tree == NULL) {
+                puts("error: out of memory for pki");
+                return -1;
+            }
+            if ((chunks[chunk_count] = malloc(PKI_CHUNK_SIZE * sizeof(network_node))) == NULL) {
+                puts("error: out of memory for pki");
+                return -1;
+            }
+            chunk_count++;
+        }
+
+        slot = index_lookup(addr);
+        *slot = node_count;
+        node = sphinx_pki_node(node_count);
+        node->addr = *addr;
+        node->weight = 0;
+
+        /* the new tree entry covers its node and the entries below it */
+        index = ++node_count;
+        weight_tree[index] = weight_prefix(index - 1) - weight_prefix(index - (index & -index));
+
+        /* new nodes are mixes with the default capacity */
+        sphinx_pki_set_weight(addr, 1);
+    }
+
+    memcpy(node->public_key, public_key, KEY_SIZE);
+    node->epoch_valid = 0;
+
+    /* private keys of other nodes are not kept */
+    if (private_key != NULL && get_local_ipv6_addr(&self_addr) > 0 && ipv6_addr_equal(&self_addr, addr)) {
+        memcpy(self_private_key, private_key, KEY_SIZE);
+        self_known = 1;
+    }
+
+    return 1;
+}
+
+int8_t sphinx_pki_set_weight(ipv6_addr_t *addr, uint16_t weight)
+{
+    uint32_t index;
+    network_node *node;
+
+    if ((index = index_of(addr)) == NO_NODE) {
+        return -1;
+    }
+
+    node = sphinx_pki_node(index);
+    weight_add(index, (int32_t) weight - node->weight);
+    node->weight = weight;
+
+    return 1;
+}
+
+/* weight range of an excluded node */
+typedef struct {
+    uint32_t start;
+    uint16_t weight;
+} weight_range;
+
+/* adds a node to the excluded ranges sorted by start, returns their new number */
+static uint8_t exclude_node(weight_range excluded[], uint8_t count, uint32_t index)
+{
+    uint32_t start = weight_prefix(index);
+    uint16_t weight = sphinx_pki_node(index)->weight;
+    uint8_t i;
+
+    /* nodes without weight are never drawn */
+    if (weight == 0) {
+        return count;
+    }
+
+    for (i=0; i<count && excluded[i].start<start; i++);
+
+    if (i < count && excluded[i].start == start) {
+        return count;
+    }
+
+    memmove(&excluded[i + 1], &excluded[i], (count - i) * sizeof(weight_range));
+    excluded[i].start = start;
+    excluded[i].weight = weight;
+
+    return count + 1;
+}
+
+int8_t sphinx_pki_sample(network_node *nodes[], uint8_t count, ipv6_addr_t *start_addr, ipv6_addr_t *dest_addr)
+{
+    /* start, destination and the drawn nodes */
+    weight_range excluded[SPHINX_MAX_PATH + 2];
+    uint8_t excluded_count = 0;
+    uint32_t available = total_weight;
+    uint32_t index, point;
+
+    if (count > SPHINX_MAX_PATH) {
+        return -1;
+    }
+
+    if ((index = index_of(start_addr)) != NO_NODE) {
+        excluded_count = exclude_node(excluded, excluded_count, index);
+    }
+    if ((index = index_of(dest_addr)) != NO_NODE) {
+        excluded_count = exclude_node(excluded, excluded_count, index);
+    }
+    for (uint8_t i=0; i<excluded_count; i++) {
+        available -= excluded[i].weight;
+    }
+
+    for (uint8_t i=0; i<count; i++) {
+        if (available == 0) {
+            return -1;
+        }
+
+        /* draw from the weights left and move the point past the excluded ranges below it */
+        point = random_uint32_range(0, available);
+        for (uint8_t k=0; k<excluded_count && excluded[k].start<=point; k++) {
+            point += excluded[k].weight;
+        }
+
+        index = weight_find(point);
+        nodes[i] = sphinx_pki_node(index);
+        excluded_count = exclude_node(excluded, excluded_count, index);
+        available -= nodes[i]->weight;
+    }
+
+    return 1;
+}
+
+void sphinx_pki_clear(void)
+{
+    /* index, chunks and tree are reset together, so no lookup can reach a slot of a removed node */
+    while (chunk_count > 0) {
+        free(chunks[--chunk_count]);
+    }
+    free(chunks);
+    free(weight_tree);
+    free(index_slots);
+    chunks = NULL;
+    weight_tree = NULL;
+    index_slots = NULL;
+    index_size = 0;
+    node_count = 0;
+    total_weight = 0;
+
+    memset(self_private_key, 0, KEY_SIZE);
+    self_known = 0;
+}
+
+void sphinx_pki_truncate(uint32_t count)
+{
+    if (count >= node_count) {
+        return;
+    }
+
+    if (count == 0) {
+        sphinx_pki_clear();
+        return;
+    }
+
+    for (uint32_t i=count; i<node_count; i++) {
+        total_weight -= sphinx_pki_node(i)->weight;
+    }
+    node_count = count;
+
+    while ((chunk_count - 1) * PKI_CHUNK_SIZE >= node_count && chunk_count > 1) {
+        free(chunks[--chunk_count]);
+    }
+
+    /* tree entries of the remaining nodes only cover remaining nodes, the index is built again */
+    memset(index_slots, 0xff, index_size * sizeof(uint32_t));
+    for (uint32_t i=0; i<node_count; i++) {
+        *index_lookup(&sphinx_pki_node(i)->addr) = i;
+    }
+}
+
+/* directory set aside while the benchmark or the simulation runs on nodes of its own */
+static struct {
+    network_node **chunks;
+    uint32_t chunk_count;
+    uint32_t node_count;
+    uint32_t *weight_tree;
+    uint32_t total_weight;
+    uint32_t *index_slots;
+    uint32_t index_size;
+    unsigned char self_private_key[KEY_SIZE];
+    uint8_t self_known;
+    uint8_t used;
+} stash;
+
+int8_t sphinx_pki_stash(void)
+{
+    if (stash.used) {
+        return -1;
+    }
+
+    stash.chunks = chunks;
+    stash.chunk_count = chunk_count;
+    stash.node_count = node_count;
+    stash.weight_tree = weight_tree;
+    stash.total_weight = total_weight;
+    stash.index_slots = index_slots;
+    stash.index_size = index_size;
+    memcpy(stash.self_private_key, self_private_key, KEY_SIZE);
+    stash.self_known = self_known;
+    stash.used = 1;
+
+    /* start over with an empty directory, the stashed one keeps its memory */
+    chunks = NULL;
+    weight_tree = NULL;
+    index_slots = NULL;
+    chunk_count = 0;
+    index_size = 0;
+    node_count = 0;
+    total_weight = 0;
+    memset(self_private_key, 0, KEY_SIZE);
+    self_known = 0;
+
+    return 1;
+}
+
+void sphinx_pki_unstash(void)
+{
+    if (!stash.used) {
+        return;
+    }
+
+    sphinx_pki_clear();
+
+    chunks = stash.chunks;
+    chunk_count = stash.chunk_count;
+    node_count = stash.node_count;
+    weight_tree = stash.weight_tree;
+    total_weight = stash.total_weight;
+    index_slots = stash.index_slots;
+    index_size = stash.index_size;
+    memcpy(self_private_key, stash.self_private_key, KEY_SIZE);
+    self_known = stash.self_known;
+
+    memset(&stash, 0, sizeof(stash));
+}
+
+int8_t sphinx_pki_add_generated(unsigned char *private_key)
+{
+    /* documentation prefix and the index of the node, the nodes only exist in this process */
+    ipv6_addr_t addr = {{0x20, 0x01, 0x0d, 0xb8, 0x00, 0x01}};
+    unsigned char public_key[KEY_SIZE];
+
+    for (uint8_t i=0; i<sizeof(uint32_t); i++) {
+        addr.u8[ADDR_SIZE - 1 - i] = node_count >> (8 * i);
+    }
+
+    /* the private key stays with the caller */
+    sphinx_keypair(public_key, private_key);
+    return sphinx_pki_add(&addr, public_key, NULL);
+}
+
+int8_t sphinx_pki_load_default(void)
+{
+    #if SPHINX_PKI_DEFAULT
+    for (uint8_t i=0; i<SPHINX_DEFAULT_PKI_SIZE; i++) {
+        if (sphinx_pki_add((ipv6_addr_t *) &sphinx_default_pki[i].addr, sphinx_default_pki[i].public_key, NULL) < 0) {
+            return -1;
+        }
+    }
+    return 1;
+    #else
+    return -1;
+    #endif /* SPHINX_PKI_DEFAULT */
+}
+
+int8_t parse_hex_key(unsigned char *dest, const char *hex)
+{
+    unsigned int byte;
+
+    if (strlen(hex) != 2 * KEY_SIZE) {
+        return -1;
+    }
+
+    for (uint8_t i=0; i<KEY_SIZE; i++) {
+        if (sscanf(&hex[2 * i], "%2x", &byte) != 1) {
+            return -1;
+        }
+        dest[i] = byte;
+    }
+
+    return 1;
+}
+
+#if defined(CPU_NATIVE) || defined(SPHINX_HOST)
+int8_t sphinx_pki_load_file(const char *path)
+{
+    /* one node per line: <ipv6 addr> <public key> [<private key>], keys in hex */
+    char line[PKI_LINE_SIZE];
+    char addr_str[IPV6_ADDR_MAX_STR_LEN];
+    char public_str[2 * KEY_SIZE + 1];
+    char private_str[2 * KEY_SIZE + 1];
+    unsigned char public_key[KEY_SIZE];
+    unsigned char private_key[KEY_SIZE];
+    ipv6_addr_t addr;
+    uint32_t line_number = 0;
+    int fields;
+    int c;
+    FILE *file;
+
+    if ((file = fopen(path, "r")) == NULL) {
+        puts("error: can't open pki file");
+        return -1;
+    }
+
+    /* the file replaces the nodes known so far */
+    sphinx_pki_clear();
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+
+        /* the rest of a line that did not fit is skipped, not parsed as another entry */
+        if (strchr(line, '\n') == NULL && !feof(file)) {
+            printf("error: pki entry in line %lu too long\n", (unsigned long) line_number);
+            while ((c = fgetc(file)) != EOF && c != '\n') {}
+            continue;
+        }
+
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+
+        fields = sscanf(line, "%45s %64s %64s", addr_str, public_str, private_str);
+
+        if (fields < 2 || ipv6_addr_from_str(&addr, addr_str) == NULL || parse_hex_key(public_key, public_str) < 0 ||
+            (fields == 3 && parse_hex_key(private_key, private_str) < 0)) {
+            printf("error: malformed pki entry in line %lu\n", (unsigned long) line_number);
+            continue;
+        }
+
+        if (sphinx_pki_add(&addr, public_key, fields == 3 ? private_key : NULL) < 0) {
+            fclose(file);
+            return -1;
+        }
+    }
+
+    memset(private_key, 0, KEY_SIZE);
+    fclose(file);
+    return 1;
+}
+#endif /* CPU_NATIVE || SPHINX_HOST */
+
+void sphinx_pki_print(void)
+{
+    for (uint32_t i=0; i<node_count; i++) {
+        ipv6_addr_print(&sphinx_pki_node(i)->addr);
+        puts("");
+    }
+}
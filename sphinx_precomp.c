@@ -0,0 +1,330 @@
+#include "shpinx.h"
+
+#if SPHINX_PRECOMP_POOL_SIZE
+
+/* pre-built headers and surbs waiting for a payload */
+static sphinx_precomp precomp_pool[SPHINX_PRECOMP_POOL_SIZE];
+
+/* destination and size class of a message to keep headers ready for */
+typedef struct {
+    ipv6_addr_t addr;
+    const sphinx_class *cls;
+} precomp_dest;
+
+/* destinations to keep headers ready for, most recently used first */
+static precomp_dest precomp_dests[SPHINX_PRECOMP_POOL_SIZE];
+static uint8_t precomp_dest_count = 0;
+
+/* lowest priority queue of the sphinx thread, NULL while it does not run */
+static event_queue_t *refill_queue = NULL;
+static void handle_refill(event_t *event);
+static event_t refill_event = { .handler = handle_refill };
+
+static void schedule_refill(void)
+{
+    if (refill_queue != NULL) {
+        event_post(refill_queue, &refill_event);
+    }
+}
+
+static uint8_t entry_matches(sphinx_precomp *entry, ipv6_addr_t *dest_addr, const sphinx_class *cls)
+{
+    return entry->used && entry->cls == cls && ipv6_addr_equal(&entry->dest_addr, dest_addr);
+}
+
+static uint8_t count_entries(precomp_dest *dest)
+{
+    uint8_t count = 0;
+
+    for (uint8_t i=0; i<SPHINX_PRECOMP_POOL_SIZE; i++) {
+        if (entry_matches(&precomp_pool[i], &dest->addr, dest->cls)) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+static void note_dest(ipv6_addr_t *dest_addr, const sphinx_class *cls)
+{
+    uint8_t i;
+
+    /* look for destination, the last slot is overwritten if it is not tracked yet */
+    for (i=0; i<precomp_dest_count; i++) {
+        if (precomp_dests[i].cls == cls && ipv6_addr_equal(&precomp_dests[i].addr, dest_addr)) {
+            break;
+        }
+    }
+
+    if (i == precomp_dest_count) {
+        if (precomp_dest_count < SPHINX_PRECOMP_POOL_SIZE) {
+            precomp_dest_count++;
+        } else {
+            /* drop headers of evicted destination */
+            for (uint8_t j=0; j<SPHINX_PRECOMP_POOL_SIZE; j++) {
+                if (entry_matches(&precomp_pool[j], &precomp_dests[i-1].addr, precomp_dests[i-1].cls)) {
+                    precomp_pool[j].used = 0;
+                }
+            }
+            i--;
+        }
+    }
+
+    /* move destination to front */
+    memmove(&precomp_dests[1], &precomp_dests[0], i * sizeof(precomp_dest));
+    precomp_dests[0].addr = *dest_addr;
+    precomp_dests[0].cls = cls;
+}
+
+int8_t sphinx_precomp_take(sphinx_ctx *ctx, unsigned char *id, ipv6_addr_t *dest_addr, char *data, size_t data_len)
+{
+    /* headers are built for one size class */
+    const sphinx_class *cls = sphinx_class_for_payload(data_len);
+
+    if (cls == NULL) {
+        return -1;
+    }
+
+    note_dest(dest_addr, cls);
+
+    /* build replacements once the thread is idle */
+    schedule_refill();
+
+    for (uint8_t i=0; i<SPHINX_PRECOMP_POOL_SIZE; i++) {
+        sphinx_precomp *entry = &precomp_pool[i];
+
+        if (!entry_matches(entry, dest_addr, cls)) {
+            continue;
+        }
+
+        /* header was built with keys of an earlier epoch */
+        if (entry->epoch != sphinx_current_epoch()) {
+            memset(entry, 0, sizeof(sphinx_precomp));
+            continue;
+        }
+
+        /* put pre-built header and surb in place */
+        ctx->cls = cls;
+        memcpy(ctx->message, entry->header, cls->header_size);
+        memcpy(&ctx->message[cls->header_size + MAC_SIZE], entry->surb, cls->surb_size);
+        memcpy(id, entry->id, ID_SIZE);
+
+        /* stream keys of the header's context are gone, derive them for the payload layers */
+        for (uint8_t j=0; j<entry->path_len_dest; j++) {
+            derive_stream_key(ctx->stream_keys[j], nonce, entry->shared_secrets[j]);
+        }
+
+        sphinx_seal_payload(ctx, entry->shared_secrets, entry->path_len_dest, data, data_len);
+
+        /* message is sent to first hop */
+        memcpy(&ctx->dest_addr, &entry->first_hop, ADDR_SIZE);
+
+        /* shared secrets must not outlive the message */
+        memset(entry, 0, sizeof(sphinx_precomp));
+        return 1;
+    }
+
+    return -1;
+}
+
+size_t sphinx_precomp_ram(void)
+{
+    return sizeof(precomp_pool) + sizeof(precomp_dests);
+}
+
+/* header build in progress, one step per event while the thread has nothing else to do */
+static sphinx_ctx *build_ctx = NULL;
+static sphinx_precomp *build_entry;
+static precomp_dest build_dest;
+
+static uint8_t find_dest(precomp_dest *dest)
+{
+    uint8_t i;
+
+    for (i=0; i<precomp_dest_count; i++) {
+        if (precomp_dests[i].cls == dest->cls && ipv6_addr_equal(&precomp_dests[i].addr, &dest->addr)) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/* picks an entry and destination to build a header for, returns 0 if all destinations are at their quota */
+static int8_t build_start(void)
+{
+    precomp_dest *dest = NULL;
+    uint8_t min_count = SPHINX_PRECOMP_PER_DEST;
+
+    build_entry = NULL;
+    for (uint8_t i=0; i<SPHINX_PRECOMP_POOL_SIZE; i++) {
+        if (!precomp_pool[i].used) {
+            build_entry = &precomp_pool[i];
+            break;
+        }
+    }
+
+    if (build_entry == NULL) {
+        return 0;
+    }
+
+    /* choose destination furthest below its quota, recently used ones first */
+    for (uint8_t i=0; i<precomp_dest_count; i++) {
+        uint8_t count = count_entries(&precomp_dests[i]);
+        if (count < min_count) {
+            min_count = count;
+            dest = &precomp_dests[i];
+        }
+    }
+
+    if (dest == NULL) {
+        return 0;
+    }
+
+    /* context is busy with another message */
+    if ((build_ctx = sphinx_ctx_alloc()) == NULL) {
+        return 0;
+    }
+
+    /* destinations may move in their list between the steps */
+    build_dest = *dest;
+    build_entry->epoch = sphinx_current_epoch();
+    random_bytes(build_entry->id, ID_SIZE);
+
+    build_ctx->cls = dest->cls;
+    build_ctx->path_len_dest = sphinx_random_path_len(build_ctx->cls);
+    build_ctx->path_len_reply = sphinx_random_path_len(build_ctx->cls);
+    build_ctx->step = SPHINX_STEP_PATH;
+
+    return 1;
+}
+
+/* runs one step of the header build, returns 1 if work is left, 0 if not and -1 if the build failed */
+static int8_t build_step(void)
+{
+    sphinx_precomp *entry = build_entry;
+    sphinx_ctx *ctx = build_ctx;
+    uint8_t i;
+
+    if (ctx == NULL) {
+        return build_start();
+    }
+
+    if (sphinx_create_step(ctx, entry->id, &build_dest.addr, NULL, 0) < 0) {
+        sphinx_ctx_free(ctx);
+        build_ctx = NULL;
+
+        /* stop tracking destinations no path can be built to */
+        if ((i = find_dest(&build_dest)) < precomp_dest_count) {
+            precomp_dest_count--;
+            memmove(&precomp_dests[i], &precomp_dests[i+1], (precomp_dest_count - i) * sizeof(precomp_dest));
+        }
+        return -1;
+    }
+
+    /* the payload is added when the header is taken */
+    if (ctx->step < SPHINX_STEP_PAYLOAD) {
+        return 1;
+    }
+
+    /* header was built with keys of an earlier epoch, or its destination was evicted meanwhile */
+    entry->dest_addr = build_dest.addr;
+    entry->cls = build_dest.cls;
+    if (entry->epoch == sphinx_current_epoch() && find_dest(&build_dest) < precomp_dest_count &&
+        count_entries(&build_dest) < SPHINX_PRECOMP_PER_DEST) {
+        entry->path_len_dest = ctx->path_len_dest;
+        memcpy(entry->header, ctx->message, ctx->cls->header_size);
+        memcpy(entry->surb, &ctx->message[ctx->cls->header_size + MAC_SIZE], ctx->cls->surb_size);
+        memcpy(&entry->first_hop, &ctx->dest_addr, ADDR_SIZE);
+        memcpy(entry->shared_secrets, ctx->shared_secrets, entry->path_len_dest * KEY_SIZE);
+        entry->used = 1;
+    }
+
+    sphinx_ctx_free(ctx);
+    build_ctx = NULL;
+
+    return 1;
+}
+
+static void handle_refill(event_t *event)
+{
+    if (build_step() != 0) {
+        event_post(refill_queue, event);
+    }
+}
+
+void sphinx_precomp_init(event_queue_t *queue)
+{
+    refill_queue = queue;
+}
+
+int8_t sphinx_precomp_cancel(void)
+{
+    if (refill_queue != NULL) {
+        event_cancel(refill_queue, &refill_event);
+    }
+
+    if (build_ctx == NULL) {
+        return 0;
+    }
+
+    sphinx_ctx_free(build_ctx);
+    build_ctx = NULL;
+
+    /* start over once the thread is idle again */
+    schedule_refill();
+    return 1;
+}
+
+int8_t sphinx_precomp_refill(void)
+{
+    int8_t res;
+
+    /* builds one header at once, for callers outside the sphinx thread loop */
+    if ((res = build_step()) <= 0) {
+        return res;
+    }
+
+    while (build_ctx != NULL) {
+        if ((res = build_step()) < 0) {
+            return res;
+        }
+    }
+
+    return 1;
+}
+
+#else
+
+int8_t sphinx_precomp_take(sphinx_ctx *ctx, unsigned char *id, ipv6_addr_t *dest_addr, char *data, size_t data_len)
+{
+    (void) ctx;
+    (void) id;
+    (void) dest_addr;
+    (void) data;
+    (void) data_len;
+
+    return -1;
+}
+
+void sphinx_precomp_init(event_queue_t *queue)
+{
+    (void) queue;
+}
+
+int8_t sphinx_precomp_cancel(void)
+{
+    return 0;
+}
+
+int8_t sphinx_precomp_refill(void)
+{
+    return 0;
+}
+
+size_t sphinx_precomp_ram(void)
+{
+    return 0;
+}
+
+#endif /* SPHINX_PRECOMP_POOL_SIZE */
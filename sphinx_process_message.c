@@ -2,58 +2,68 @@
 
 int8_t process_reply(unsigned char *message)
 {
-    /* look for id in sent messages */
-    for (uint8_t i=0; i<sent_msg_count; i++) {
-        /* delet if found */
-        if (memcmp(&message[CUTT_OFF + ADDR_SIZE], sent_msg_table[i].id, ID_SIZE) == 0) {
-            memcpy(&sent_msg_table[i], &sent_msg_table[i+1], (SENT_MSG_TABLE_SIZE - sent_msg_count) * sizeof(event_send));
-            sent_msg_count--;
-            print_id(&message[KEY_SIZE]);
-            puts("message acknoleged");
-            return 1;
-        }
+    #if SPHINX_STATS
+    event_send *msg;
+
+    /* round trip since the last transmit */
+    if ((msg = inflight_find(&message[CUTT_OFF + ADDR_SIZE])) != NULL) {
+        STATS_TIME(ack_rtt, (ztimer_now(ZTIMER_MSEC) - msg->timestamp) * 1000);
+    }
+    #endif /* SPHINX_STATS */
+
+    /* look for id in sent messages and delete it if found */
+    if (inflight_remove(&message[CUTT_OFF + ADDR_SIZE]) > 0) {
+        STATS_COUNT(acked);
+        print_id(&message[KEY_SIZE]);
+        puts("message acknoleged");
+        return 1;
     }
 
     puts("error: id of acknolegement not found");
     return -1;
 }
 
-int8_t receive_message(unsigned char *message, unsigned char *public_key, unsigned char *shared_secret)
+int8_t receive_message(unsigned char *message, const sphinx_class *cls, unsigned char *public_key, unsigned char *shared_secret)
 {
     ipv6_addr_t first_reply_hop;
 
     unsigned char blinding_factor[KEY_SIZE];
 
     /* verify integrity of surb and payload */
-    if (crypto_onetimeauth_verify(&message[HEADER_SIZE], &message[HEADER_SIZE + MAC_SIZE], SURB_SIZE + PAYLOAD_SIZE, shared_secret) < 0) {
+    if (sphinx_onetimeauth_verify(&message[cls->header_size], &message[cls->header_size + MAC_SIZE], cls->surb_size + cls->payload_size, shared_secret) < 0) {
+        STATS_COUNT(mac_failures);
         puts("error: surb and payload authentication failed");
         return -1;
     }
 
-    /* print message */
-    printf("sphinx: %s\n", &message[HEADER_SIZE + MAC_SIZE + SURB_SIZE]);
+    /* deliver payload or its fragment, unaccepted fragments are not acknowledged */
+    if (fragment_receive(&message[cls->header_size + MAC_SIZE + cls->surb_size], cls->payload_size) < 0) {
+        return -1;
+    }
 
     /* parse address of first reply hop */
-    memcpy(&first_reply_hop, &message[HEADER_SIZE + MAC_SIZE], ADDR_SIZE);
+    memcpy(&first_reply_hop, &message[cls->header_size + MAC_SIZE], ADDR_SIZE);
 
     /* calculate public key for next hop */
     hash_blinding_factor(blinding_factor, public_key, shared_secret);
-    crypto_scalarmult(message, blinding_factor, public_key);
+    sphinx_scalarmult(message, blinding_factor, public_key);
 
     /* move mac and routing of surb to header position */
-    memmove(&message[KEY_SIZE], &message[HEADER_SIZE + MAC_SIZE + ADDR_SIZE], MAC_SIZE + ENC_ROUTING_SIZE);
+    memmove(&message[KEY_SIZE], &message[cls->header_size + MAC_SIZE + ADDR_SIZE], MAC_SIZE + cls->enc_routing_size);
 
     /* fill rest with random bytes */
-    random_bytes(&message[HEADER_SIZE], MAC_SIZE + SURB_SIZE + PAYLOAD_SIZE);
+    random_bytes(&message[cls->header_size], MAC_SIZE + cls->surb_size + cls->payload_size);
 
-    if (udp_send(&first_reply_hop, message, SPHINX_MESSAGE_SIZE) < 0) {
+    if (sphinx_transport(&first_reply_hop, message, cls->message_size) < 0) {
         return -1;
     }
 
+    STATS_COUNT(delivered);
+
     return 1;
 }
 
-int8_t forward_message(unsigned char *message, unsigned char *public_key, unsigned char *shared_secret)
+int8_t forward_message(unsigned char *message, const sphinx_class *cls, unsigned char *public_key, unsigned char *shared_secret)
 {
     ipv6_addr_t next_hop;
 
@@ -64,90 +74,110 @@ int8_t forward_message(unsigned char *message, unsigned char *public_key, unsign
 
     /* calculate public key for next hop */
     hash_blinding_factor(blinding_factor, public_key, shared_secret);
-    crypto_scalarmult(message, blinding_factor, public_key);
+    sphinx_scalarmult(message, blinding_factor, public_key);
 
-    if (udp_send(&next_hop, message, SPHINX_MESSAGE_SIZE) < 0) {
+    /* sent right away or with the next flush of the mix pool */
+    if (sphinx_mix_forward(&next_hop, message, cls->message_size) < 0) {
         return -1;
     }
 
+    STATS_COUNT(forwarded);
     puts("sphinx: message forwarded");
     return 1;
 }
 
 
-int8_t sphinx_process_message(unsigned char *message, network_node *node_self, unsigned char tag_table[][TAG_SIZE], uint8_t *tag_count)
+/* the keyring is only read here and may be shared by threads, callers rotate it with sphinx_keyring_update */
+int8_t sphinx_process_message(unsigned char *message, const sphinx_class *cls, sphinx_keyring *keyring)
 {
+    /* this node */
+    network_node *node_self = keyring->node;
+
+    /* key of the epoch the message was built for */
+    epoch_key *key = NULL;
+
     /* shared secret */
-    unsigned char raw_shared_secret[KEY_SIZE];
     unsigned char shared_secret[KEY_SIZE];
 
     /* public key of message */
     unsigned char public_key[KEY_SIZE];
 
+    uint32_t start = STATS_NOW();
+    int8_t res;
+
+    STATS_COUNT(received);
+
     /* check if public key is valid point on ecc (not supported by tweetnacl) */
 
     /* save public key */
     memcpy(public_key, message, KEY_SIZE);
 
-    /* calculate shared secret for decryption */
-    crypto_scalarmult(raw_shared_secret, node_self->private_key, public_key);
-    hash_shared_secret(shared_secret, raw_shared_secret);
+    /* calculate shared secret for decryption, the epoch key whose shared secret verifies the routing information was used */
+    for (uint8_t i=0; i<SPHINX_KEY_EPOCHS; i++) {
+        if ((key = epoch_shared_secret(shared_secret, keyring, public_key, i)) != NULL &&
+            sphinx_onetimeauth_verify(&message[KEY_SIZE], &message[KEY_SIZE + MAC_SIZE], cls->enc_routing_size, shared_secret) > 0) {
+            break;
+        }
+        key = NULL;
+    }
 
     #if DEBUG
     puts("DEBUG: message received");
-    print_hex_memory(message, SPHINX_MESSAGE_SIZE);
+    print_hex_memory(message, cls->message_size);
     puts("DEBUG: shared secret");
     print_hex_memory(shared_secret, KEY_SIZE);
     #endif /* DEBUG */
 
-    /* check for duplicate */
-    for (uint8_t i=0; i<*tag_count; i++) {
-        if (memcmp(shared_secret, &tag_table[i], TAG_SIZE) == 0) {
-            puts("error: duplicate detected");
-            return -1;
-        }
+    /* verify encrypted routing information */
+    if (key == NULL) {
+        STATS_COUNT(mac_failures);
+        printf("error: message authentication failed, or built for an epoch other than %lu outside the clock skew\n",
+               (unsigned long) keyring->epoch);
+        return -1;
     }
 
-    /* check if tag table is full */
-    if (*tag_count == 128) {
-        *tag_count = 0;
-        puts("sphinx: rotated public key"); //theory
+    /* clock of the sender or of this node is off by an epoch */
+    if (key->epoch != keyring->epoch) {
+        STATS_COUNT(epoch_mismatches);
+        printf("sphinx: message built for epoch %lu, local epoch %lu\n",
+               (unsigned long) key->epoch, (unsigned long) keyring->epoch);
     }
 
-    /* save message tag */
-    memcpy(&tag_table[*tag_count], shared_secret, TAG_SIZE);
-    (*tag_count)++;
-
-
-    /* verify encrypted routing information */
-    if (crypto_onetimeauth_verify(&message[KEY_SIZE], &message[KEY_SIZE + MAC_SIZE], ENC_ROUTING_SIZE, shared_secret) < 0) {
-        puts("error: message authentication failed");
+    /* check for duplicate and save message tag */
+    if ((res = replay_filter_check(&key->replay, shared_secret)) < 0) {
+        STATS_COUNT(replays);
+        puts("error: duplicate detected");
+        return -1;
+    }
+    if (res == 0) {
+        STATS_COUNT(replay_overflows);
+        puts("error: replay filter of the epoch key is full");
         return -1;
     }
 
     /* move the encrypted routing info 32 bytes to the left in the header to make space for the node padding */
-    memmove(&message[KEY_SIZE + MAC_SIZE - NODE_PADDING_SIZE], &message[KEY_SIZE + MAC_SIZE], ENC_ROUTING_SIZE);
+    memmove(&message[KEY_SIZE + MAC_SIZE - NODE_PADDING_SIZE], &message[KEY_SIZE + MAC_SIZE], cls->enc_routing_size);
 
     /* set the node padding */
-    memset(&message[HEADER_SIZE - NODE_PADDING_SIZE], 0, NODE_PADDING_SIZE);
+    memset(&message[cls->header_size - NODE_PADDING_SIZE], 0, NODE_PADDING_SIZE);
 
     /* decrypt message */
-    crypto_stream(prg_stream, PRG_STREAM_SIZE, nonce, shared_secret);
-    xor_backwards_inplace(message, SPHINX_MESSAGE_SIZE, prg_stream, PRG_STREAM_SIZE, PRG_STREAM_SIZE);
+    xor_stream(&message[cls->message_size - cls->prg_stream_size], cls->prg_stream_size, 0, nonce, shared_secret);
 
     /* check if message is forward, receive or reply */
     if (ipv6_addr_equal(&node_self->addr, (ipv6_addr_t *) &message[CUTT_OFF])) {
 
         if (message[CUTT_OFF + ADDR_SIZE] == 0x00 && memcmp(&message[CUTT_OFF + ADDR_SIZE], &message[CUTT_OFF + ADDR_SIZE + 1], ID_SIZE - 1) == 0) {
-            return receive_message(message, public_key, shared_secret);
+            res = receive_message(message, cls, public_key, shared_secret);
+            STATS_TIME(process_receive, STATS_NOW() - start);
         } else {
-            return process_reply(message);
+            res = process_reply(message);
+            STATS_TIME(process_reply, STATS_NOW() - start);
         }
-
-        puts("error: corrupted payload");
-        return -1;
-        
     } else {
-        return forward_message(message, public_key, shared_secret);
+        res = forward_message(message, cls, public_key, shared_secret);
+        STATS_TIME(process_forward, STATS_NOW() - start);
     }
+
+    return res;
 }
\ No newline at end of file
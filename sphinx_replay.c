@@ -0,0 +1,70 @@
+#include "shpinx.h"
+
+/* tags are the first bytes of a hashed shared secret, so they are used as hash value directly */
+static uint32_t tag_slot(unsigned char *tag)
+{
+    uint32_t slot = 0;
+
+    for (uint8_t i=0; i<TAG_SIZE && i<sizeof(uint32_t); i++) {
+        slot |= (uint32_t) tag[i] << (8 * i);
+    }
+
+    return slot & (SPHINX_REPLAY_SLOTS - 1);
+}
+
+/* returns 1 if tag is in table, else the slot to insert it is stored in free_slot */
+static int8_t table_lookup(replay_table *table, unsigned char *tag, uint32_t *free_slot)
+{
+    uint32_t slot = tag_slot(tag);
+
+    /* linear probing, the load limit guarantees a free slot */
+    while (table->used[slot / 8] & (1 << (slot % 8))) {
+        if (memcmp(table->tags[slot], tag, TAG_SIZE) == 0) {
+            return 1;
+        }
+        slot = (slot + 1) & (SPHINX_REPLAY_SLOTS - 1);
+    }
+
+    *free_slot = slot;
+    return 0;
+}
+
+void replay_filter_init(replay_filter *filter)
+{
+    memset(filter, 0, sizeof(replay_filter));
+
+    for (uint8_t i=0; i<SPHINX_REPLAY_SHARDS; i++) {
+        mutex_init(&filter->shards[i].lock);
+    }
+}
+
+int8_t replay_filter_check(replay_filter *filter, unsigned char *tag)
+{
+    /* the last tag byte picks the shard, the slot in it comes from the first ones */
+    replay_shard *shard = &filter->shards[tag[TAG_SIZE - 1] % SPHINX_REPLAY_SHARDS];
+    replay_table *table = &shard->table;
+    uint32_t slot;
+
+    mutex_lock(&shard->lock);
+
+    /* check for duplicate */
+    if (table_lookup(table, tag, &slot)) {
+        mutex_unlock(&shard->lock);
+        return -1;
+    }
+
+    /* tags are kept for the whole epoch, a full table takes no more messages under this key */
+    if (table->count >= SPHINX_REPLAY_CAPACITY) {
+        mutex_unlock(&shard->lock);
+        return 0;
+    }
+
+    /* save message tag */
+    memcpy(table->tags[slot], tag, TAG_SIZE);
+    table->used[slot / 8] |= 1 << (slot % 8);
+    table->count++;
+
+    mutex_unlock(&shard->lock);
+
+    return 1;
+}
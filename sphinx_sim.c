@@ -0,0 +1,262 @@
+#include "shpinx.h"
+
+#if SPHINX_SIM
+
+/* a sphinx message on its way between two simulated nodes */
+typedef struct {
+    ipv6_addr_t dest_addr;
+    uint16_t msg;
+    size_t size;
+    unsigned char message[SPHINX_MESSAGE_SIZE];
+} sim_packet;
+
+/* every message has at most one packet in flight, so the window bounds the queue */
+static sim_packet queue[SPHINX_INFLIGHT_SIZE];
+static uint16_t queue_head = 0;
+static uint16_t queue_count = 0;
+
+/* keys and seen tags of every simulated node, in the order of the pki */
+static sphinx_keyring *keyrings;
+static uint32_t node_count;
+
+/* start time of the messages in the window and latencies of completed ones */
+static uint32_t started[SPHINX_INFLIGHT_SIZE];
+static unsigned char ids[SPHINX_INFLIGHT_SIZE][ID_SIZE];
+static uint32_t latencies[SPHINX_SIM_MESSAGES];
+
+/* message the node currently processing works on, and if it sent a packet */
+static uint16_t current_msg;
+static uint8_t sent;
+
+static int8_t sim_send(ipv6_addr_t *dest_addr, unsigned char *message, size_t message_size)
+{
+    sim_packet *packet;
+
+    if (queue_count == SPHINX_INFLIGHT_SIZE) {
+        return -1;
+    }
+
+    packet = &queue[(queue_head + queue_count) % SPHINX_INFLIGHT_SIZE];
+    packet->dest_addr = *dest_addr;
+    packet->msg = current_msg;
+    packet->size = message_size;
+    memcpy(packet->message, message, message_size);
+    queue_count++;
+    sent = 1;
+
+    return 1;
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* creates a message between two random nodes and queues it to its first hop */
+static int8_t sim_start_message(sphinx_ctx *ctx, uint16_t msg)
+{
+    unsigned char shared_secrets[2*SPHINX_MAX_PATH][KEY_SIZE];
+    char data[PAYLOAD_SIZE] = {0};
+    uint32_t sender = random_uint32_range(0, node_count);
+    uint32_t dest = (sender + random_uint32_range(1, node_count)) % node_count;
+    uint8_t path_len_dest;
+    event_send *desc;
+
+    /* messages of all size classes are mixed */
+    ctx->cls = &sphinx_classes[random_uint32_range(0, SPHINX_CLASS_COUNT)];
+    path_len_dest = sphinx_random_path_len(ctx->cls);
+
+    /* the sender waits for the acknowledgement like a real node */
+    if ((desc = inflight_alloc()) == NULL) {
+        return -1;
+    }
+    random_bytes(ids[msg], ID_SIZE);
+    memcpy(desc->id, ids[msg], ID_SIZE);
+    desc->transmit_count = 1;
+    desc->timestamp = ztimer_now(ZTIMER_MSEC);
+    inflight_insert(desc);
+
+    started[msg] = ztimer_now(ZTIMER_USEC);
+    fragment_encode((unsigned char *) data, msg + 1, 0, 1, "sim", 3);
+
+    /* paths are built around the address of the sending node */
+    local_addr = sphinx_pki_node(sender)->addr;
+    if (sphinx_create_header(ctx, shared_secrets, path_len_dest, sphinx_random_path_len(ctx->cls), ids[msg], &sphinx_pki_node(dest)->addr) < 0) {
+        inflight_remove(ids[msg]);
+        return -1;
+    }
+    sphinx_seal_payload(ctx, shared_secrets, path_len_dest, data, ctx->cls->payload_size);
+
+    current_msg = msg;
+    return sim_send(&ctx->dest_addr, ctx->message, ctx->cls->message_size);
+}
+
+/* puts the directory of this node aside and fills a new one with generated nodes */
+static int8_t sim_add_nodes(uint32_t nodes)
+{
+    unsigned char private_key[KEY_SIZE];
+
+    if (sphinx_pki_stash() < 0) {
+        return -1;
+    }
+
+    /* the private keys are only kept in the keyrings of the nodes */
+    if ((keyrings = malloc(nodes * sizeof(sphinx_keyring))) == NULL) {
+        puts("error: out of memory for simulated nodes");
+        sphinx_pki_unstash();
+        return -1;
+    }
+
+    for (node_count=0; node_count<nodes; node_count++) {
+        if (sphinx_pki_add_generated(private_key) < 0) {
+            break;
+        }
+        sphinx_keyring_init(&keyrings[node_count], sphinx_pki_node(node_count), private_key);
+    }
+    memset(private_key, 0, KEY_SIZE);
+
+    return node_count == nodes ? 1 : -1;
+}
+
+/* drops the generated nodes with their keys and puts the directory of this node back */
+static void sim_remove_nodes(void)
+{
+    if (keyrings != NULL) {
+        memset(keyrings, 0, node_count * sizeof(sphinx_keyring));
+        free(keyrings);
+        keyrings = NULL;
+    }
+    node_count = 0;
+
+    sphinx_pki_unstash();
+}
+
+int8_t sphinx_sim(uint16_t messages, uint16_t window, uint32_t nodes)
+{
+    sphinx_transport_t transport = sphinx_transport;
+    uint8_t mix_threshold = sphinx_mix_threshold;
+    uint16_t free_msgs[SPHINX_INFLIGHT_SIZE];
+    uint16_t free_count = 0;
+    uint16_t started_count = 0;
+    uint16_t done = 0;
+    uint16_t failed = 0;
+    uint32_t start, elapsed;
+    uint64_t sum = 0;
+    sphinx_ctx *ctx;
+    sim_packet *packet;
+    ipv6_addr_t addr = local_addr;
+    uint32_t node;
+    int8_t res;
+
+    if (messages == 0 || messages > SPHINX_SIM_MESSAGES) {
+        messages = SPHINX_SIM_MESSAGES;
+    }
+    if (nodes == 0) {
+        nodes = SPHINX_SIM_NODES;
+    }
+
+    /* paths of the longest size class need their mixes besides sender and destination */
+    if (nodes < SPHINX_MAX_PATH + 1) {
+        printf("error: the simulation needs at least %u nodes\n", SPHINX_MAX_PATH + 1);
+        return -1;
+    }
+    if (window == 0 || window > SPHINX_INFLIGHT_SIZE - inflight_count()) {
+        window = SPHINX_INFLIGHT_SIZE - inflight_count();
+    }
+
+    /* sent messages free their slots only with the timeouts of the sphinx thread, which the loop does not serve */
+    if (window == 0) {
+        puts("error: no free slot for sent messages, wait for their timeouts");
+        return -1;
+    }
+
+    if ((ctx = sphinx_ctx_alloc()) == NULL) {
+        return -1;
+    }
+
+    /* the simulated nodes replace the directory of this node until the simulation ends */
+    if (sim_add_nodes(nodes) < 0) {
+        sim_remove_nodes();
+        sphinx_ctx_free(ctx);
+        return -1;
+    }
+    for (uint16_t i=0; i<window; i++) {
+        free_msgs[free_count++] = i;
+    }
+    queue_head = 0;
+    queue_count = 0;
+
+    /* packets of the simulation never leave this process and are forwarded without the mix pool */
+    sphinx_transport = sim_send;
+    sphinx_mix_threshold = 0;
+    start = ztimer_now(ZTIMER_USEC);
+
+    while (done + failed < messages) {
+
+        /* keep the window full */
+        while (started_count < messages && free_count > 0) {
+            uint16_t msg = free_msgs[--free_count];
+            started_count++;
+            if (sim_start_message(ctx, msg) < 0) {
+                free_msgs[free_count++] = msg;
+                failed++;
+            }
+        }
+
+        if (queue_count == 0) {
+            continue;
+        }
+
+        /* deliver the oldest packet to its node */
+        packet = &queue[queue_head];
+        queue_head = (queue_head + 1) % SPHINX_INFLIGHT_SIZE;
+        queue_count--;
+
+        current_msg = packet->msg;
+        sent = 0;
+        res = -1;
+        if ((node = sphinx_pki_index(&packet->dest_addr)) < node_count) {
+            sphinx_keyring_update(&keyrings[node]);
+            res = sphinx_process_message(packet->message, sphinx_class_for_message(packet->size), &keyrings[node]);
+        }
+
+        if (res < 0) {
+            inflight_remove(ids[current_msg]);
+            failed++;
+        } else if (!sent) {
+            /* acknowledgement reached the sender */
+            latencies[done++] = ztimer_now(ZTIMER_USEC) - started[current_msg];
+        } else {
+            continue;
+        }
+        free_msgs[free_count++] = current_msg;
+    }
+
+    elapsed = ztimer_now(ZTIMER_USEC) - start;
+    sphinx_transport = transport;
+    sphinx_mix_threshold = mix_threshold;
+    local_addr = addr;
+    sphinx_ctx_free(ctx);
+    sim_remove_nodes();
+
+    qsort(latencies, done, sizeof(uint32_t), compare_latencies);
+    for (uint16_t i=0; i<done; i++) {
+        sum += latencies[i];
+    }
+
+    printf("sim: %u messages, %u failed, window %u, %lu nodes, %lu ms\n", done, failed, window, (unsigned long) nodes,
+           (unsigned long) (elapsed / 1000));
+    printf("sim: %lu messages/s\n", (unsigned long) (elapsed ? (uint64_t) done * 1000000 / elapsed : 0));
+    if (done > 0) {
+        printf("sim: latency us mean %lu p50 %lu p99 %lu max %lu\n", (unsigned long) (sum / done),
+               (unsigned long) latencies[done / 2], (unsigned long) latencies[(done - 1) * 99 / 100],
+               (unsigned long) latencies[done - 1]);
+    }
+
+    return failed == 0 ? 1 : -1;
+}
+
+#endif /* SPHINX_SIM */
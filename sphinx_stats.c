@@ -0,0 +1,78 @@
+#include "shpinx.h"
+
+#if SPHINX_STATS
+
+sphinx_statistics sphinx_stats;
+
+static void print_histogram(const char *name, stats_histogram *histogram)
+{
+    printf("sphinx: %s us", name);
+
+    /* bucket i holds durations from 2^(i-1) to 2^i - 1 us, the last one everything above */
+    for (uint8_t i=0; i<SPHINX_STATS_BUCKETS; i++) {
+        if (histogram->buckets[i] == 0) {
+            continue;
+        }
+        if (i == SPHINX_STATS_BUCKETS - 1) {
+            printf(" >=%lu:%lu", 1UL << (i - 1), (unsigned long) histogram->buckets[i]);
+        } else {
+            printf(" <%lu:%lu", 1UL << i, (unsigned long) histogram->buckets[i]);
+        }
+    }
+    puts("");
+}
+
+void sphinx_stats_print(void)
+{
+    uint32_t elapsed = ztimer_now(ZTIMER_MSEC) - sphinx_stats.wakeups_since;
+
+    printf("sphinx: received %lu sent %lu forwarded %lu delivered %lu acked %lu\n",
+           (unsigned long) sphinx_stats.received, (unsigned long) sphinx_stats.sent, (unsigned long) sphinx_stats.forwarded,
+           (unsigned long) sphinx_stats.delivered, (unsigned long) sphinx_stats.acked);
+    printf("sphinx: retransmitted %lu discarded %lu mac failures %lu replays %lu replay filter full %lu epoch mismatches %lu\n",
+           (unsigned long) sphinx_stats.retransmitted, (unsigned long) sphinx_stats.discarded,
+           (unsigned long) sphinx_stats.mac_failures, (unsigned long) sphinx_stats.replays,
+           (unsigned long) sphinx_stats.replay_overflows, (unsigned long) sphinx_stats.epoch_mismatches);
+    printf("sphinx: receive batches %lu, %lu.%02lu messages per wakeup\n", (unsigned long) sphinx_stats.recv_batches,
+           (unsigned long) (sphinx_stats.recv_batches ? sphinx_stats.received / sphinx_stats.recv_batches : 0),
+           (unsigned long) (sphinx_stats.recv_batches ? sphinx_stats.received * 100 / sphinx_stats.recv_batches % 100 : 0));
+
+    printf("sphinx: wakeups %lu in %lu s, %lu per minute\n", (unsigned long) sphinx_stats.wakeups,
+           (unsigned long) (elapsed / 1000),
+           (unsigned long) (elapsed ? (uint64_t) sphinx_stats.wakeups * 60000 / elapsed : 0));
+
+    #if SPHINX_MIX_POOL_SIZE
+    printf("sphinx: mix flushes %lu, %lu.%02lu messages per flush, peak occupancy %lu\n", (unsigned long) sphinx_stats.mix_flushes,
+           (unsigned long) (sphinx_stats.mix_flushes ? sphinx_stats.mix_flushed / sphinx_stats.mix_flushes : 0),
+           (unsigned long) (sphinx_stats.mix_flushes ? sphinx_stats.mix_flushed * 100 / sphinx_stats.mix_flushes % 100 : 0),
+           (unsigned long) sphinx_stats.mix_peak);
+    #endif /* SPHINX_MIX_POOL_SIZE */
+
+    print_histogram("create", &sphinx_stats.create);
+    print_histogram("process forward", &sphinx_stats.process_forward);
+    print_histogram("process receive", &sphinx_stats.process_receive);
+    print_histogram("process reply", &sphinx_stats.process_reply);
+    print_histogram("ack rtt", &sphinx_stats.ack_rtt);
+    #if SPHINX_MIX_POOL_SIZE
+    print_histogram("mix delay", &sphinx_stats.mix_delay);
+    #endif /* SPHINX_MIX_POOL_SIZE */
+}
+
+void sphinx_stats_reset(void)
+{
+    memset(&sphinx_stats, 0, sizeof(sphinx_statistics));
+    sphinx_stats.wakeups_since = ztimer_now(ZTIMER_MSEC);
+}
+
+#else
+
+void sphinx_stats_print(void)
+{
+    puts("sphinx: statistics disabled, build with SPHINX_STATS=1");
+}
+
+void sphinx_stats_reset(void)
+{
+}
+
+#endif /* SPHINX_STATS */